@@ -1,167 +1,1209 @@
 // cain implemented with ncnn library
 
 #include "cain.h"
+#include "cain_cpu.h"
+#include "cain_layers.h"
+#include "cain_allocator.h"
+#include "cain_autotune.h"
+#include "cain_cache.h"
 
+#include <string.h>
 #include <algorithm>
 #include <vector>
 #include "benchmark.h"
+#include "datareader.h"
+#include "cpu.h"
+
+#if _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include "cain_preproc.comp.hex.h"
 #include "cain_postproc.comp.hex.h"
 
-CAIN::CAIN(int gpuid)
+#if CAIN_EMBED_MODEL
+#include "cain.mem.h"
+#endif
+
+// param text and weights read once per process and shared by every CAIN instance
+// the nets reference the weights in place, so the data lives until the last instance is gone
+class CAINModelData
+{
+public:
+    int refcount;
+#if _WIN32
+    std::wstring key;
+#else
+    std::string key;
+#endif
+    std::vector<char> param;
+    int param_binary;
+    unsigned char* bin;
+    size_t binsize;
+
+    // bin is a read-only file mapping backed by the page cache, otherwise fastMalloc
+    int mapped;
+#if _WIN32
+    HANDLE mapping;
+#endif
+};
+
+static ncnn::Mutex g_model_data_lock;
+static std::vector<CAINModelData*> g_model_data;
+
+#if _WIN32
+static FILE* open_model_file(const wchar_t* path)
+{
+    FILE* fp = _wfopen(path, L"rb");
+    if (!fp)
+    {
+        fwprintf(stderr, L"_wfopen %ls failed\n", path);
+    }
+
+    return fp;
+}
+#else
+static FILE* open_model_file(const char* path)
+{
+    FILE* fp = fopen(path, "rb");
+    if (!fp)
+    {
+        fprintf(stderr, "fopen %s failed\n", path);
+    }
+
+    return fp;
+}
+#endif
+
+static size_t read_model_file(FILE* fp, unsigned char** data, size_t padding)
+{
+    fseek(fp, 0, SEEK_END);
+    size_t length = ftell(fp);
+    rewind(fp);
+
+    // fastMalloc keeps the weights aligned for the zero-copy load_model
+    *data = (unsigned char*)ncnn::fastMalloc(length + padding);
+    if (!*data)
+        return 0;
+
+    size_t nread = fread(*data, 1, length, fp);
+    memset(*data + nread, 0, padding);
+
+    return nread;
+}
+
+// map cain.bin read-only so the weights are paged in on first touch and shared with
+// every other process mapping the same file, page alignment covers what load_model needs
+#if _WIN32
+static int map_model_file(const wchar_t* path, CAINModelData* data)
+{
+    HANDLE file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return -1;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+    {
+        CloseHandle(file);
+        return -1;
+    }
+
+    HANDLE mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (!mapping)
+        return -1;
+
+    void* ptr = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!ptr)
+    {
+        CloseHandle(mapping);
+        return -1;
+    }
+
+    data->bin = (unsigned char*)ptr;
+    data->binsize = (size_t)size.QuadPart;
+    data->mapped = 1;
+    data->mapping = mapping;
+
+    return 0;
+}
+#else
+static int map_model_file(const char* path, CAINModelData* data)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    void* ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED)
+        return -1;
+
+    data->bin = (unsigned char*)ptr;
+    data->binsize = st.st_size;
+    data->mapped = 1;
+
+    return 0;
+}
+#endif
+
+static void free_model_file(CAINModelData* data)
+{
+    if (!data->bin)
+        return;
+
+    if (data->mapped)
+    {
+#if _WIN32
+        UnmapViewOfFile(data->bin);
+        CloseHandle(data->mapping);
+#else
+        munmap(data->bin, data->binsize);
+#endif
+    }
+    else
+    {
+        ncnn::fastFree(data->bin);
+    }
+
+    data->bin = 0;
+    data->binsize = 0;
+    data->mapped = 0;
+#if _WIN32
+    data->mapping = 0;
+#endif
+}
+
+#if _WIN32
+static CAINModelData* acquire_model_data(const std::wstring& modeldir, const wchar_t* name)
+#else
+static CAINModelData* acquire_model_data(const std::string& modeldir, const char* name)
+#endif
+{
+    ncnn::MutexLockGuard guard(g_model_data_lock);
+
+#if _WIN32
+    const std::wstring key = modeldir + L"/" + name;
+#else
+    const std::string key = modeldir + "/" + name;
+#endif
+
+    for (size_t i = 0; i < g_model_data.size(); i++)
+    {
+        if (g_model_data[i]->key == key)
+        {
+            g_model_data[i]->refcount++;
+            return g_model_data[i];
+        }
+    }
+
+#if _WIN32
+    const std::wstring parampath = key + L".param";
+    const std::wstring parambinpath = key + L".param.bin";
+    const std::wstring modelpath = key + L".bin";
+#else
+    const std::string parampath = key + ".param";
+    const std::string parambinpath = key + ".param.bin";
+    const std::string modelpath = key + ".bin";
+#endif
+
+    CAINModelData* data = new CAINModelData;
+    data->refcount = 1;
+    data->key = key;
+    data->param_binary = 0;
+    data->bin = 0;
+    data->binsize = 0;
+
+    {
+        // prefer the binary param from ncnn2mem, it needs no text parsing
+#if _WIN32
+        FILE* fp = _wfopen(parambinpath.c_str(), L"rb");
+#else
+        FILE* fp = fopen(parambinpath.c_str(), "rb");
+#endif
+        if (fp)
+        {
+            data->param_binary = 1;
+        }
+        else
+        {
+            fp = open_model_file(parampath.c_str());
+        }
+
+        if (fp)
+        {
+            unsigned char* param = 0;
+            size_t length = read_model_file(fp, &param, 1);
+            if (param)
+            {
+                // null terminated for load_param_mem
+                data->param.assign((const char*)param, (const char*)param + length + 1);
+                ncnn::fastFree(param);
+            }
+
+            fclose(fp);
+        }
+    }
+    if (map_model_file(modelpath.c_str(), data) != 0)
+    {
+        // no mapping on this filesystem, read it into memory
+        FILE* fp = open_model_file(modelpath.c_str());
+        if (fp)
+        {
+            data->binsize = read_model_file(fp, &data->bin, 0);
+
+            fclose(fp);
+        }
+    }
+
+    g_model_data.push_back(data);
+
+    return data;
+}
+
+static void release_model_data(CAINModelData* data)
+{
+    if (!data)
+        return;
+
+    ncnn::MutexLockGuard guard(g_model_data_lock);
+
+    if (--data->refcount > 0)
+        return;
+
+    g_model_data.erase(std::find(g_model_data.begin(), g_model_data.end(), data));
+
+    free_model_file(data);
+    delete data;
+}
+
+static int load_param_data(ncnn::Net& net, const CAINModelData* data)
+{
+    if (data->param.empty() || !data->bin)
+        return -1;
+
+    if (data->param_binary)
+    {
+        // load_param on memory returns the bytes read even for a broken file, load_param_bin returns the status
+        const unsigned char* mem = (const unsigned char*)data->param.data();
+        ncnn::DataReaderFromMemory dr(mem);
+        return net.load_param_bin(dr);
+    }
+
+    return net.load_param_mem(data->param.data());
+}
+
+static void load_model_data(ncnn::Net& net, const CAINModelData* data)
+{
+    if (data->param.empty() || !data->bin)
+        return;
+
+    // weights are referenced in place instead of being copied into the net
+    size_t consumed = net.load_model(data->bin);
+    if (consumed != data->binsize)
+    {
+        fprintf(stderr, "model size mismatch %lu != %lu\n", (unsigned long)consumed, (unsigned long)data->binsize);
+    }
+}
+
+// graph paths through cainnet, each has its own allocation sequence
+enum
+{
+    CAIN_PATH_FRAME = 0,
+    CAIN_PATH_TILE = 1,
+    CAIN_PATH_GAP = 2,
+    CAIN_PATH_COUNT = 3
+};
+
+// everything that only depends on the padded input size, set up by the first frame of that size
+// and reused by every later one, so that switching between sizes does not start over
+class CAINExecutionPlan
+{
+public:
+    CAINExecutionPlan()
+    {
+        for (int i = 0; i < CAIN_PATH_COUNT; i++)
+        {
+            memory_plans[i] = 0;
+        }
+
+        vkallocator_block_size = 0;
+    }
+
+    ~CAINExecutionPlan()
+    {
+        for (int i = 0; i < CAIN_PATH_COUNT; i++)
+        {
+            delete memory_plans[i];
+        }
+
+        for (size_t i = 0; i < blob_vkallocators.size(); i++)
+        {
+            delete blob_vkallocators[i];
+            delete staging_vkallocators[i];
+        }
+    }
+
+    // cpu, static memory plan of each graph path, recorded by its first pass
+    CAINMemoryPlan* memory_plans[CAIN_PATH_COUNT];
+
+    // gpu, idle allocator pairs whose blocks hold the feature maps of this size, one pair per concurrent pass
+    size_t vkallocator_block_size;
+    std::vector<ncnn::VkAllocator*> blob_vkallocators;
+    std::vector<ncnn::VkAllocator*> staging_vkallocators;
+};
+
+#if defined(__i386__) || defined(__x86_64__) || defined(_M_IX86) || defined(_M_X64)
+#define CAIN_CPU_X86 1
+#else
+#define CAIN_CPU_X86 0
+#endif
+
+// the cheapest precision the cpu computes natively
+static int cpu_native_precision()
+{
+#if CAIN_CPU_X86
+    // ncnn x86 convolution has no fp16 or bf16 kernels, every layer would cast its blobs back to fp32
+    return CAIN_PRECISION_FP32;
+#else
+    if (ncnn::cpu_support_arm_asimdhp())
+        return CAIN_PRECISION_FP16;
+
+    if (ncnn::cpu_support_arm_bf16())
+        return CAIN_PRECISION_BF16;
+
+    return CAIN_PRECISION_FP32;
+#endif
+}
+
+CAIN::CAIN(int gpuid, int _num_threads)
 {
-    vkdev = ncnn::get_gpu_device(gpuid);
+    vkdev = gpuid == -1 ? 0 : ncnn::get_gpu_device(gpuid);
     cain_preproc = 0;
     cain_postproc = 0;
+    num_threads = _num_threads;
+    tilesize = 0;
+    prepadding = 64;
+    model_data = 0;
+    autotune_width = 0;
+    autotune_height = 0;
+    use_int8 = 0;
+    precision = CAIN_PRECISION_FP32;
+    reorg_stride = 8;
+    padding_alignment = 32;
+    max_channels = 192;
+    frame_cache_vkallocator = vkdev ? new CAINLockedVkBlobAllocator(vkdev) : 0;
+}
+
+CAIN::~CAIN()
+{
+    // cleanup preprocess and postprocess pipeline
+    {
+        delete cain_preproc;
+        delete cain_postproc;
+    }
+
+    // cached frames go back to their allocator first
+    {
+        frame_cache.clear();
+        frame_cache_gpu.clear();
+
+        delete frame_cache_vkallocator;
+    }
+
+    // every pass has returned its allocator by now
+    {
+        for (size_t i = 0; i < arena_allocators.size(); i++)
+        {
+            delete arena_allocators[i];
+        }
+        arena_allocators.clear();
+
+        for (std::map<unsigned long long, CAINExecutionPlan*>::iterator it = execution_plans.begin(); it != execution_plans.end(); ++it)
+        {
+            delete it->second;
+        }
+        execution_plans.clear();
+    }
+
+    // the net references the shared weights, drop it before them
+    {
+        cainnet.clear();
+
+        release_model_data(model_data);
+    }
+}
+
+void CAIN::autotune_convolution(const std::vector<ncnn::ParamDict>& params)
+{
+    // the convolution the graph repeats most, cain.param is almost only 3x3 192 -> 192 at 1/8 resolution
+    int conv_index = -1;
+    {
+        const std::vector<ncnn::Layer*>& layers = cainnet.layers();
+
+        int best_count = 0;
+        for (size_t i = 0; i < layers.size(); i++)
+        {
+            if (layers[i]->typeindex != ncnn::LayerType::Convolution || params[i].get(3, 1) != 1)
+                continue;
+
+            int count = 0;
+            for (size_t j = 0; j < layers.size(); j++)
+            {
+                if (layers[j]->typeindex != ncnn::LayerType::Convolution || params[j].get(3, 1) != 1)
+                    continue;
+
+                if (params[j].get(0, 0) == params[i].get(0, 0) && params[j].get(1, 0) == params[i].get(1, 0) && params[j].get(6, 0) == params[i].get(6, 0))
+                    count++;
+            }
+
+            if (count > best_count)
+            {
+                conv_index = (int)i;
+                best_count = count;
+            }
+        }
+    }
+
+    if (conv_index == -1)
+        return;
+
+    const ncnn::ParamDict& pd = params[conv_index];
+
+    // large frames run tile by tile, the convolution then only ever sees the map of one tile with its halo
+    int pass_w = autotune_width;
+    int pass_h = autotune_height;
+    if (tilesize > 0 && (pass_w > tilesize || pass_h > tilesize))
+    {
+        pass_w = std::min(pass_w, tilesize + prepadding * 2);
+        pass_h = std::min(pass_h, tilesize + prepadding * 2);
+    }
+
+    const int w = padded_size(pass_w) / reorg_stride;
+    const int h = padded_size(pass_h) / reorg_stride;
+
+    unsigned long long hash = CAIN_CACHE_HASH_INIT;
+    {
+        const int key[13] = {
+            w,
+            h,
+            pd.get(0, 0),
+            pd.get(1, 0),
+            pd.get(6, 0),
+            cainnet.opt.num_threads,
+            cainnet.opt.use_fp16_storage,
+            cainnet.opt.use_fp16_arithmetic,
+            cainnet.opt.use_bf16_storage,
+            ncnn::cpu_support_x86_avx512(),
+            ncnn::cpu_support_x86_avx2(),
+            ncnn::cpu_support_arm_asimdhp(),
+            ncnn::get_cpu_count()
+        };
+
+        hash = cain_cache_hash(hash, key, sizeof(key));
+        hash = cain_cache_hash(hash, NCNN_VERSION_STRING, strlen(NCNN_VERSION_STRING));
+    }
+
+    int algorithm = CAIN_CONV_DEFAULT;
+
+#if _WIN32
+    const std::wstring path = cain_cache_path(cachedir, "conv-autotune", hash, "txt");
+    const std::wstring tmppath = cain_cache_temp_path(path);
+    FILE* fp = cachedir.empty() ? 0 : _wfopen(path.c_str(), L"rb");
+#else
+    const std::string path = cain_cache_path(cachedir, "conv-autotune", hash, "txt");
+    const std::string tmppath = cain_cache_temp_path(path);
+    FILE* fp = cachedir.empty() ? 0 : fopen(path.c_str(), "rb");
+#endif
+
+    // tuned before on this machine
+    if (fp)
+    {
+        char name[32];
+        if (fscanf(fp, "%31s", name) == 1)
+        {
+            algorithm = cain_convolution_algorithm_from_name(name);
+        }
+
+        fclose(fp);
+    }
+
+    if (algorithm == CAIN_CONV_DEFAULT)
+    {
+        algorithm = cain_autotune_convolution(pd, w, h, cainnet.opt);
+
+        fprintf(stderr, "autotune convolution %d x %d : %s\n", w, h, cain_convolution_algorithm_name(algorithm));
+
+        if (!cachedir.empty() && algorithm != CAIN_CONV_DEFAULT)
+        {
+            // write aside and rename so that concurrent jobs never read a partial file
+#if _WIN32
+            fp = _wfopen(tmppath.c_str(), L"wb");
+#else
+            fp = fopen(tmppath.c_str(), "wb");
+#endif
+            if (fp)
+            {
+                int nwrite = fprintf(fp, "%s\n", cain_convolution_algorithm_name(algorithm));
+                fclose(fp);
+
+#if _WIN32
+                if (nwrite <= 0 || !MoveFileExW(tmppath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING))
+                    _wremove(tmppath.c_str());
+#else
+                if (nwrite <= 0 || rename(tmppath.c_str(), path.c_str()) != 0)
+                    remove(tmppath.c_str());
+#endif
+            }
+        }
+    }
+
+    cain_set_convolution_algorithm(cainnet.opt, algorithm);
 }
 
-CAIN::~CAIN()
-{
-    // cleanup preprocess and postprocess pipeline
+#if _WIN32
+int CAIN::load(const std::wstring& modeldir)
+#else
+int CAIN::load(const std::string& modeldir)
+#endif
+{
+    ncnn::Option opt;
+    opt.num_threads = num_threads;
+    opt.use_vulkan_compute = vkdev ? true : false;
+    opt.use_fp16_packed = vkdev ? true : false;
+    opt.use_fp16_storage = vkdev ? true : false;
+    opt.use_fp16_arithmetic = false;
+    opt.use_int8_storage = true;
+    opt.use_int8_inference = true;
+
+    if (!vkdev)
+    {
+        int cpu_precision = precision == CAIN_PRECISION_AUTO ? cpu_native_precision() : precision;
+
+#if CAIN_CPU_X86
+        if (cpu_precision == CAIN_PRECISION_FP16 || cpu_precision == CAIN_PRECISION_BF16)
+        {
+            fprintf(stderr, "x86 convolution computes in fp32, %s feature maps add casts around every layer\n", cpu_precision == CAIN_PRECISION_FP16 ? "fp16" : "bf16");
+        }
+#endif
+
+        // fp16 storage needs hardware conversion at least, ncnn would cast every blob back to fp32 otherwise
+        if (cpu_precision == CAIN_PRECISION_FP16 && !ncnn::cpu_support_arm_asimdhp() && !ncnn::cpu_support_x86_f16c())
+        {
+            fprintf(stderr, "cpu has no fp16 support, fp32 is used\n");
+            cpu_precision = CAIN_PRECISION_FP32;
+        }
+
+        if (cpu_precision == CAIN_PRECISION_FP16)
+        {
+            opt.use_fp16_packed = true;
+            opt.use_fp16_storage = true;
+            // f16c only converts, armv8.2 computes in fp16 as well
+            opt.use_fp16_arithmetic = ncnn::cpu_support_arm_asimdhp();
+        }
+
+        if (cpu_precision == CAIN_PRECISION_BF16)
+        {
+            opt.use_bf16_storage = true;
+        }
+    }
+
+    cainnet.opt = opt;
+
+    // ncnn has no int8 convolution on vulkan, it would bounce every quantized layer through the cpu
+    const int int8 = use_int8 && !vkdev;
+    if (use_int8 && vkdev)
+    {
+        fprintf(stderr, "int8 model is cpu only, gpu keeps fp16\n");
+    }
+
+    if (vkdev)
+    {
+        cainnet.set_vulkan_device(vkdev);
+    }
+
+#if CAIN_EMBED_MODEL
+    // param and weights are compiled in and referenced in place
+    (void)modeldir;
+    if (int8)
+    {
+        fprintf(stderr, "int8 model is not compiled in, fp32 is used\n");
+    }
+    {
+        const unsigned char* mem = cain_param_bin;
+        ncnn::DataReaderFromMemory dr(mem);
+        if (cainnet.load_param_bin(dr) != 0)
+        {
+            fprintf(stderr, "load cain param failed\n");
+            return -1;
+        }
+    }
+#else
+#if _WIN32
+    model_data = acquire_model_data(modeldir, int8 ? L"cain-int8" : L"cain");
+#else
+    model_data = acquire_model_data(modeldir, int8 ? "cain-int8" : "cain");
+#endif
+
+    if (!model_data || load_param_data(cainnet, model_data) != 0)
+    {
+        fprintf(stderr, "load cain param failed\n");
+        return -1;
+    }
+#endif
+
+    // resolve the blobs we feed and fetch from the graph structure, binary param carries no names
+    // x.1 -> Reorg_13 -> 523, x.3 -> Reorg_27 -> 551, 4040 -> PixelShuffle -> 4070
+    {
+        in_blob = -1;
+        in0_reorg_blob = -1;
+        in1_reorg_blob = -1;
+        out_reorg_blob = -1;
+        out_blob = -1;
+        gap_blobs.clear();
+
+        const std::vector<ncnn::Layer*>& layers = cainnet.layers();
+        for (size_t i = 0; i < layers.size(); i++)
+        {
+            const ncnn::Layer* layer = layers[i];
+
+            if (layer->typeindex == ncnn::LayerType::Reorg)
+            {
+                if (in0_reorg_blob == -1)
+                {
+                    in_blob = layer->bottoms[0];
+                    in0_reorg_blob = layer->tops[0];
+                }
+                else
+                {
+                    in1_reorg_blob = layer->tops[0];
+                }
+            }
+
+            if (layer->typeindex == ncnn::LayerType::PixelShuffle)
+            {
+                out_reorg_blob = layer->bottoms[0];
+                out_blob = layer->tops[0];
+            }
+
+            // the channel attention GlobalAveragePool outputs, fed from a whole frame pass in tile mode
+            if (layer->typeindex == ncnn::LayerType::Pooling)
+                gap_blobs.push_back(layer->tops[0]);
+        }
+
+        if (in1_reorg_blob == -1 || out_blob == -1)
+        {
+            fprintf(stderr, "unexpected cain model structure\n");
+            return -1;
+        }
+    }
+
+    // the graph is read back once more for the layer params ncnn does not keep
+    std::vector<ncnn::ParamDict> params;
+    {
+#if CAIN_EMBED_MODEL
+        cain_load_layer_params(cain_param_bin, 1, params);
+#else
+        if (model_data && !model_data->param.empty())
+        {
+            cain_load_layer_params((const unsigned char*)model_data->param.data(), model_data->param_binary, params);
+        }
+#endif
+    }
+
+    // pad the input only as far as the strides in the graph need
+    {
+        reorg_stride = 8;
+        padding_alignment = 32;
+
+        const std::vector<ncnn::Layer*>& layers = cainnet.layers();
+        for (size_t i = 0; i < params.size() && i < layers.size(); i++)
+        {
+            if (layers[i]->typeindex == ncnn::LayerType::Reorg)
+            {
+                reorg_stride = params[i].get(0, 1);
+                break;
+            }
+        }
+
+        int alignment = cain_input_alignment(cainnet, params);
+        if (alignment > 0)
+        {
+            padding_alignment = alignment;
+        }
+    }
+
+    // the widest feature map sizes the gpu allocator blocks
+    {
+        max_channels = 192;
+
+        const std::vector<ncnn::Layer*>& layers = cainnet.layers();
+        for (size_t i = 0; i < params.size() && i < layers.size(); i++)
+        {
+            if (layers[i]->typeindex == ncnn::LayerType::Convolution)
+            {
+                max_channels = std::max(max_channels, params[i].get(0, 0));
+            }
+        }
+    }
+
+    // the convolution algorithm is fixed when load_model creates the pipelines
+    if (!vkdev && autotune_width > 0 && autotune_height > 0 && !params.empty())
+    {
+        autotune_convolution(params);
+    }
+
+#if CAIN_EMBED_MODEL
+    cainnet.load_model(cain_bin);
+#else
+    if (model_data)
+    {
+        load_model_data(cainnet, model_data);
+    }
+#endif
+
+    // fused layer rewrite, the blobs resolved above keep their indices
+    if (!params.empty())
+    {
+        if (cain_fuse_layers(cainnet, params, cachedir) != 0)
+        {
+            fprintf(stderr, "fuse cain layers failed\n");
+            return -1;
+        }
+    }
+
+    // initialize preprocess and postprocess pipeline
+    if (vkdev)
+    {
+        std::vector<ncnn::vk_specialization_type> specializations(1);
+#if _WIN32
+        specializations[0].i = 1;
+#else
+        specializations[0].i = 0;
+#endif
+
+        {
+            static std::vector<uint32_t> spirv;
+            static ncnn::Mutex lock;
+            {
+                ncnn::MutexLockGuard guard(lock);
+                if (spirv.empty())
+                {
+                    cain_compile_spirv_module_cached(cain_preproc_comp_data, sizeof(cain_preproc_comp_data), "cain_preproc", opt, vkdev, cachedir, spirv);
+                }
+            }
+
+            cain_preproc = new ncnn::Pipeline(vkdev);
+            cain_preproc->set_optimal_local_size_xyz(8, 8, 3);
+            cain_preproc->create(spirv.data(), spirv.size() * 4, specializations);
+        }
+
+        {
+            static std::vector<uint32_t> spirv;
+            static ncnn::Mutex lock;
+            {
+                ncnn::MutexLockGuard guard(lock);
+                if (spirv.empty())
+                {
+                    cain_compile_spirv_module_cached(cain_postproc_comp_data, sizeof(cain_postproc_comp_data), "cain_postproc", opt, vkdev, cachedir, spirv);
+                }
+            }
+
+            cain_postproc = new ncnn::Pipeline(vkdev);
+            cain_postproc->set_optimal_local_size_xyz(8, 8, 3);
+            cain_postproc->create(spirv.data(), spirv.size() * 4, specializations);
+        }
+    }
+
+    return 0;
+}
+
+int CAIN::preproc_gpu(const ncnn::Mat& image, const float mean_rgb[3], int w_padded, int h_padded, ncnn::VkMat& out_gpu_reorg, ncnn::VkCompute& cmd, const ncnn::Option& opt) const
+{
+    const unsigned char* pixeldata = (const unsigned char*)image.data;
+    const int w = image.w;
+    const int h = image.h;
+    const int channels = 3;//image.elempack;
+
+    const size_t in_out_tile_elemsize = opt.use_fp16_storage ? 2u : 4u;
+
+    ncnn::Mat in;
+    if (opt.use_fp16_storage && opt.use_int8_storage)
+    {
+        in = ncnn::Mat(w, h, (unsigned char*)pixeldata, (size_t)channels, 1);
+    }
+    else
+    {
+#if _WIN32
+        in = ncnn::Mat::from_pixels(pixeldata, ncnn::Mat::PIXEL_BGR2RGB, w, h);
+#else
+        in = ncnn::Mat::from_pixels(pixeldata, ncnn::Mat::PIXEL_RGB, w, h);
+#endif
+    }
+
+    // upload
+    ncnn::VkMat in_gpu;
+    {
+        cmd.record_clone(in, in_gpu, opt);
+    }
+
+    // preproc
+    ncnn::VkMat in_gpu_padded;
+    {
+        in_gpu_padded.create(w_padded, h_padded, 3, in_out_tile_elemsize, 1, opt.blob_vkallocator);
+
+        std::vector<ncnn::VkMat> bindings(2);
+        bindings[0] = in_gpu;
+        bindings[1] = in_gpu_padded;
+
+        std::vector<ncnn::vk_constant_type> constants(9);
+        constants[0].i = in_gpu.w;
+        constants[1].i = in_gpu.h;
+        constants[2].i = in_gpu.cstep;
+        constants[3].i = in_gpu_padded.w;
+        constants[4].i = in_gpu_padded.h;
+        constants[5].i = in_gpu_padded.cstep;
+#if _WIN32
+        constants[6].f = mean_rgb[2];
+        constants[7].f = mean_rgb[1];
+        constants[8].f = mean_rgb[0];
+#else
+        constants[6].f = mean_rgb[0];
+        constants[7].f = mean_rgb[1];
+        constants[8].f = mean_rgb[2];
+#endif
+
+        cmd.record_pipeline(cain_preproc, bindings, constants, in_gpu_padded);
+    }
+
+    // space-to-depth with Reorg_13, the same op as Reorg_27
+    {
+        ncnn::Extractor ex = cainnet.create_extractor();
+        ex.set_blob_vkallocator(opt.blob_vkallocator);
+        ex.set_workspace_vkallocator(opt.workspace_vkallocator);
+        ex.set_staging_vkallocator(opt.staging_vkallocator);
+
+        ex.input(in_blob, in_gpu_padded);
+
+        // save some memory
+        in_gpu_padded.release();
+
+        ex.extract(in0_reorg_blob, out_gpu_reorg, cmd);
+    }
+
+    return 0;
+}
+
+int CAIN::preproc_gpu_cached(const ncnn::Mat& image, const float mean_rgb[3], int id, int w_padded, int h_padded, ncnn::VkMat& out_gpu_reorg, ncnn::VkCompute& cmd, const ncnn::Option& opt) const
+{
+    if (id < 0)
+    {
+        // not shared with another pair
+        return preproc_gpu(image, mean_rgb, w_padded, h_padded, out_gpu_reorg, cmd, opt);
+    }
+
+    {
+        ncnn::MutexLockGuard guard(frame_cache_lock);
+
+        std::map<int, ncnn::VkMat>::const_iterator it = frame_cache_gpu.find(id);
+        if (it != frame_cache_gpu.end() && it->second.w == w_padded / reorg_stride && it->second.h == h_padded / reorg_stride)
+        {
+            out_gpu_reorg = it->second;
+            return 0;
+        }
+    }
+
+    // preprocess outside the lock so that misses on different frames run concurrently
+    // the tensor outlives this pass and is shared with other threads, finish it before it is published
+    ncnn::Option opt_cache = opt;
+    opt_cache.blob_vkallocator = frame_cache_vkallocator;
+    opt_cache.workspace_vkallocator = frame_cache_vkallocator;
+
+    {
+        ncnn::VkCompute cmd_cache(vkdev);
+
+        preproc_gpu(image, mean_rgb, w_padded, h_padded, out_gpu_reorg, cmd_cache, opt_cache);
+
+        cmd_cache.submit_and_wait();
+    }
+
+    ncnn::MutexLockGuard guard(frame_cache_lock);
+
+    // another thread may have finished the same frame meanwhile, keep the one already shared
+    std::map<int, ncnn::VkMat>::const_iterator it = frame_cache_gpu.find(id);
+    if (it != frame_cache_gpu.end() && it->second.w == w_padded / reorg_stride && it->second.h == h_padded / reorg_stride)
+    {
+        out_gpu_reorg = it->second;
+        return 0;
+    }
+
+    frame_cache_gpu[id] = out_gpu_reorg;
+
+    return 0;
+}
+
+void CAIN::preproc_cpu(const ncnn::Mat& image, const float mean_rgb[3], int w_padded, int h_padded, ncnn::Mat& out_reorg, const ncnn::Option& opt) const
+{
+    const unsigned char* pixeldata = (const unsigned char*)image.data;
+    const int w = image.w;
+    const int h = image.h;
+
+#if _WIN32
+    const int bgr = 1;
+    const float mean_rgb_ordered[3] = {mean_rgb[2], mean_rgb[1], mean_rgb[0]};
+#else
+    const int bgr = 0;
+    const float mean_rgb_ordered[3] = {mean_rgb[0], mean_rgb[1], mean_rgb[2]};
+#endif
+
+    // preproc, border replicate and space-to-depth in one pass
+    // the result feeds Concat_28 directly and Reorg_13 / Reorg_27 never run
+    cain_preproc_reorg(pixeldata, w, h, bgr, mean_rgb_ordered, w_padded, h_padded, reorg_stride, out_reorg, opt);
+}
+
+void CAIN::preproc_cpu_cached(const ncnn::Mat& image, const float mean_rgb[3], int id, int w_padded, int h_padded, ncnn::Mat& out_reorg, const ncnn::Option& opt) const
+{
+    if (id < 0)
+    {
+        // not shared with another pair
+        preproc_cpu(image, mean_rgb, w_padded, h_padded, out_reorg, opt);
+        return;
+    }
+
+    {
+        ncnn::MutexLockGuard guard(frame_cache_lock);
+
+        std::map<int, ncnn::Mat>::const_iterator it = frame_cache.find(id);
+        if (it != frame_cache.end() && it->second.w == w_padded / reorg_stride && it->second.h == h_padded / reorg_stride)
+        {
+            out_reorg = it->second;
+            return;
+        }
+    }
+
+    // preprocess outside the lock so that misses on different frames run concurrently
+    preproc_cpu(image, mean_rgb, w_padded, h_padded, out_reorg, opt);
+
+    ncnn::MutexLockGuard guard(frame_cache_lock);
+
+    // another thread may have finished the same frame meanwhile, keep the one already shared
+    std::map<int, ncnn::Mat>::const_iterator it = frame_cache.find(id);
+    if (it != frame_cache.end() && it->second.w == w_padded / reorg_stride && it->second.h == h_padded / reorg_stride)
+    {
+        out_reorg = it->second;
+        return;
+    }
+
+    frame_cache[id] = out_reorg;
+}
+
+int CAIN::padded_size(int size) const
+{
+    // the smallest feature map is padded_size / padding_alignment, reflect padding needs two pixels of it
+    // a thin frame or a downscaled tile pass like 256 x 3 still gets a valid map on each axis
+    const int aligned = (size + padding_alignment - 1) / padding_alignment * padding_alignment;
+    return std::max(aligned, padding_alignment * 2);
+}
+
+unsigned long long CAIN::bucket(int w, int h) const
+{
+    const int w_padded = padded_size(w);
+    const int h_padded = padded_size(h);
+
+    return ((unsigned long long)w_padded << 32) | (unsigned int)h_padded;
+}
+
+CAINExecutionPlan* CAIN::find_execution_plan(int w_padded, int h_padded) const
+{
+    const unsigned long long key = ((unsigned long long)w_padded << 32) | (unsigned int)h_padded;
+
+    std::map<unsigned long long, CAINExecutionPlan*>::iterator it = execution_plans.find(key);
+    if (it != execution_plans.end())
+        return it->second;
+
+    CAINExecutionPlan* plan = new CAINExecutionPlan;
+    execution_plans[key] = plan;
+
+    return plan;
+}
+
+CAINArenaAllocator* CAIN::acquire_arena_allocator(int w_padded, int h_padded, int path) const
+{
+    ncnn::MutexLockGuard guard(execution_plan_lock);
+
+    CAINArenaAllocator* allocator = 0;
+    if (arena_allocators.empty())
+    {
+        allocator = new CAINArenaAllocator;
+    }
+    else
+    {
+        allocator = arena_allocators.back();
+        arena_allocators.pop_back();
+    }
+
+    // record the first pass, concurrent first passes all record and the first to finish wins
+    const CAINExecutionPlan* plan = find_execution_plan(w_padded, h_padded);
+    allocator->begin(plan->memory_plans[path]);
+
+    return allocator;
+}
+
+void CAIN::reclaim_arena_allocator(CAINArenaAllocator* allocator, int w_padded, int h_padded, int path) const
+{
+    CAINMemoryPlan* memory_plan = new CAINMemoryPlan;
+    if (allocator->end(*memory_plan) != 0)
+    {
+        delete memory_plan;
+        memory_plan = 0;
+    }
+
+    ncnn::MutexLockGuard guard(execution_plan_lock);
+
+    arena_allocators.push_back(allocator);
+
+    if (!memory_plan)
+        return;
+
+    CAINExecutionPlan* plan = find_execution_plan(w_padded, h_padded);
+    if (plan->memory_plans[path])
+    {
+        delete memory_plan;
+        return;
+    }
+
+    plan->memory_plans[path] = memory_plan;
+
+    size_t planned_count = 0;
+    size_t total_size = 0;
+    for (size_t i = 0; i < memory_plan->sizes.size(); i++)
     {
-        delete cain_preproc;
-        delete cain_postproc;
+        if (memory_plan->offsets[i] == (size_t)-1)
+            continue;
+
+        planned_count++;
+        total_size += memory_plan->sizes[i];
     }
+
+    static const char* path_names[] = {"frame", "tile", "gap"};
+    fprintf(stderr, "memory plan %s %d x %d : %d allocations %.2f MB peak %.2f MB\n", path_names[path], w_padded, h_padded, (int)planned_count, total_size / 1048576.0, memory_plan->arena_size / 1048576.0);
 }
 
-#if _WIN32
-static void load_param_model(ncnn::Net& net, const std::wstring& modeldir, const wchar_t* name)
+void CAIN::acquire_vkallocators(int w, int h, ncnn::VkAllocator** blob_vkallocator, ncnn::VkAllocator** staging_vkallocator) const
 {
-    wchar_t parampath[256];
-    wchar_t modelpath[256];
-    swprintf(parampath, 256, L"%s/%s.param", modeldir.c_str(), name);
-    swprintf(modelpath, 256, L"%s/%s.bin", modeldir.c_str(), name);
+    const int w_padded = padded_size(w);
+    const int h_padded = padded_size(h);
 
-    {
-        FILE* fp = _wfopen(parampath, L"rb");
-        if (!fp)
-        {
-            fwprintf(stderr, L"_wfopen %ls failed\n", parampath);
-        }
+    ncnn::MutexLockGuard guard(execution_plan_lock);
 
-        net.load_param(fp);
+    CAINExecutionPlan* plan = find_execution_plan(w_padded, h_padded);
 
-        fclose(fp);
+    if (!plan->blob_vkallocators.empty())
+    {
+        *blob_vkallocator = plan->blob_vkallocators.back();
+        *staging_vkallocator = plan->staging_vkallocators.back();
+        plan->blob_vkallocators.pop_back();
+        plan->staging_vkallocators.pop_back();
+        return;
     }
+
+    if (plan->vkallocator_block_size == 0)
     {
-        FILE* fp = _wfopen(modelpath, L"rb");
-        if (!fp)
+        // the largest pass through the net, a whole frame or a tile with its halo
+        int pass_w = w_padded;
+        int pass_h = h_padded;
+        if (tilesize > 0 && (w > tilesize || h > tilesize))
         {
-            fwprintf(stderr, L"_wfopen %ls failed\n", modelpath);
+            pass_w = std::min(pass_w, padded_size(tilesize + prepadding * 2));
+            pass_h = std::min(pass_h, padded_size(tilesize + prepadding * 2));
         }
 
-        net.load_model(fp);
-
-        fclose(fp);
+        // a block holds a handful of the widest feature maps, so one pass lives in a few buffers
+        // instead of spilling across many default sized ones
+        const size_t elemsize = cainnet.opt.use_fp16_storage ? 2u : 4u;
+        const size_t feature_size = (size_t)(pass_w / reorg_stride) * (pass_h / reorg_stride) * max_channels * elemsize;
+        const size_t block_size = std::max(feature_size * 4, (size_t)16 * 1024 * 1024);
+        plan->vkallocator_block_size = (block_size + 1024 * 1024 - 1) / (1024 * 1024) * (1024 * 1024);
     }
+
+    *blob_vkallocator = new ncnn::VkBlobAllocator(vkdev, plan->vkallocator_block_size);
+    *staging_vkallocator = new ncnn::VkStagingAllocator(vkdev);
 }
-#else
-static void load_param_model(ncnn::Net& net, const std::string& modeldir, const char* name)
+
+void CAIN::reclaim_vkallocators(int w, int h, ncnn::VkAllocator* blob_vkallocator, ncnn::VkAllocator* staging_vkallocator) const
 {
-    char parampath[256];
-    char modelpath[256];
-    sprintf(parampath, "%s/%s.param", modeldir.c_str(), name);
-    sprintf(modelpath, "%s/%s.bin", modeldir.c_str(), name);
+    const int w_padded = padded_size(w);
+    const int h_padded = padded_size(h);
+
+    ncnn::MutexLockGuard guard(execution_plan_lock);
 
-    net.load_param(parampath);
-    net.load_model(modelpath);
+    // the buffers stay allocated for the next frame of this size
+    CAINExecutionPlan* plan = find_execution_plan(w_padded, h_padded);
+    plan->blob_vkallocators.push_back(blob_vkallocator);
+    plan->staging_vkallocators.push_back(staging_vkallocator);
 }
-#endif
 
-#if _WIN32
-int CAIN::load(const std::wstring& modeldir)
-#else
-int CAIN::load(const std::string& modeldir)
-#endif
+void CAIN::release_frame(int id) const
 {
-    ncnn::Option opt;
-    opt.use_vulkan_compute = true;
-    opt.use_fp16_packed = true;
-    opt.use_fp16_storage = true;
-    opt.use_fp16_arithmetic = false;
-    opt.use_int8_storage = true;
-
-    cainnet.opt = opt;
+    ncnn::MutexLockGuard guard(frame_cache_lock);
 
-    cainnet.set_vulkan_device(vkdev);
+    frame_cache.erase(id);
+    frame_cache_gpu.erase(id);
+}
 
-#if _WIN32
-    load_param_model(cainnet, modeldir, L"cain");
-#else
-    load_param_model(cainnet, modeldir, "cain");
-#endif
+static ncnn::Mat crop_pixels(const ncnn::Mat& image, int x, int y, int w, int h)
+{
+    ncnn::Mat roi(w, h, (size_t)3u, 3);
 
-    // initialize preprocess and postprocess pipeline
+    for (int i = 0; i < h; i++)
     {
-        std::vector<ncnn::vk_specialization_type> specializations(1);
-#if _WIN32
-        specializations[0].i = 1;
-#else
-        specializations[0].i = 0;
-#endif
+        const unsigned char* src = (const unsigned char*)image.data + ((y + i) * image.w + x) * 3;
+        unsigned char* dst = (unsigned char*)roi.data + i * w * 3;
 
-        {
-            static std::vector<uint32_t> spirv;
-            static ncnn::Mutex lock;
-            {
-                ncnn::MutexLockGuard guard(lock);
-                if (spirv.empty())
-                {
-                    compile_spirv_module(cain_preproc_comp_data, sizeof(cain_preproc_comp_data), opt, spirv);
-                }
-            }
+        memcpy(dst, src, w * 3);
+    }
 
-            cain_preproc = new ncnn::Pipeline(vkdev);
-            cain_preproc->set_optimal_local_size_xyz(8, 8, 3);
-            cain_preproc->create(spirv.data(), spirv.size() * 4, specializations);
-        }
+    return roi;
+}
 
-        {
-            static std::vector<uint32_t> spirv;
-            static ncnn::Mutex lock;
-            {
-                ncnn::MutexLockGuard guard(lock);
-                if (spirv.empty())
-                {
-                    compile_spirv_module(cain_postproc_comp_data, sizeof(cain_postproc_comp_data), opt, spirv);
-                }
-            }
+static void paste_pixels(const ncnn::Mat& roi, int roi_x, int roi_y, ncnn::Mat& image, int x, int y, int w, int h)
+{
+    for (int i = 0; i < h; i++)
+    {
+        const unsigned char* src = (const unsigned char*)roi.data + ((roi_y + i) * roi.w + roi_x) * 3;
+        unsigned char* dst = (unsigned char*)image.data + ((y + i) * image.w + x) * 3;
 
-            cain_postproc = new ncnn::Pipeline(vkdev);
-            cain_postproc->set_optimal_local_size_xyz(8, 8, 3);
-            cain_postproc->create(spirv.data(), spirv.size() * 4, specializations);
-        }
+        memcpy(dst, src, w * 3);
     }
-
-    return 0;
 }
 
-static void image_mean(const ncnn::Mat& image, float mean_rgb[3])
+static ncnn::Mat downscale_pixels(const ncnn::Mat& image, int maxsize)
 {
-    const unsigned char* pixeldata = (const unsigned char*)image.data;
     const int w = image.w;
     const int h = image.h;
-    const int size = w * h;
+    const int outw = std::max(w * maxsize / std::max(w, h), 1);
+    const int outh = std::max(h * maxsize / std::max(w, h), 1);
 
-    float mean_r = 0.f;
-    float mean_g = 0.f;
-    float mean_b = 0.f;
-    for (int i = 0; i < size; i++)
-    {
-        mean_r += pixeldata[0];
-        mean_g += pixeldata[1];
-        mean_b += pixeldata[2];
+    ncnn::Mat small(outw, outh, (size_t)3u, 3);
 
-        pixeldata += 3;
-    }
+    ncnn::resize_bilinear_c3((const unsigned char*)image.data, w, h, (unsigned char*)small.data, outw, outh);
 
-    mean_rgb[0] = mean_r / size / 255.f;
-    mean_rgb[1] = mean_g / size / 255.f;
-    mean_rgb[2] = mean_b / size / 255.f;
+    return small;
 }
 
-int CAIN::process(const ncnn::Mat& in0image, const ncnn::Mat& in1image, float timestep, ncnn::Mat& outimage) const
+int CAIN::process(const ncnn::Mat& in0image, const ncnn::Mat& in1image, const float in0mean[3], const float in1mean[3], int in0id, int in1id, float timestep, ncnn::Mat& outimage) const
 {
     if (timestep == 0.f)
     {
@@ -175,143 +1217,178 @@ int CAIN::process(const ncnn::Mat& in0image, const ncnn::Mat& in1image, float ti
         return 0;
     }
 
-    const unsigned char* pixel0data = (const unsigned char*)in0image.data;
-    const unsigned char* pixel1data = (const unsigned char*)in1image.data;
+    if (!vkdev)
+    {
+        // cpu only
+        return process_cpu(in0image, in1image, in0mean, in1mean, in0id, in1id, timestep, outimage);
+    }
+
     const int w = in0image.w;
     const int h = in0image.h;
-    const int channels = 3;//in0image.elempack;
-
-    float mean_rgb0[3];
-    float mean_rgb1[3];
-    image_mean(in0image, mean_rgb0);
-    image_mean(in1image, mean_rgb1);
 
 //     fprintf(stderr, "%d x %d\n", w, h);
 
-    ncnn::VkAllocator* blob_vkallocator = vkdev->acquire_blob_allocator();
-    ncnn::VkAllocator* staging_vkallocator = vkdev->acquire_staging_allocator();
+    // allocators of this input size, their buffers already fit the pass
+    ncnn::VkAllocator* blob_vkallocator = 0;
+    ncnn::VkAllocator* staging_vkallocator = 0;
+    acquire_vkallocators(w, h, &blob_vkallocator, &staging_vkallocator);
 
     ncnn::Option opt = cainnet.opt;
     opt.blob_vkallocator = blob_vkallocator;
     opt.workspace_vkallocator = blob_vkallocator;
     opt.staging_vkallocator = staging_vkallocator;
 
-    // pad to 32n
-    int w_padded = (w + 31) / 32 * 32;
-    int h_padded = (h + 31) / 32 * 32;
-
-    const size_t in_out_tile_elemsize = opt.use_fp16_storage ? 2u : 4u;
-
-    ncnn::Mat in0;
-    ncnn::Mat in1;
-    if (opt.use_fp16_storage && opt.use_int8_storage)
+    if (tilesize <= 0 || (w <= tilesize && h <= tilesize))
     {
-        in0 = ncnn::Mat(w, h, (unsigned char*)pixel0data, (size_t)channels, 1);
-        in1 = ncnn::Mat(w, h, (unsigned char*)pixel1data, (size_t)channels, 1);
+        // whole frame at once
+        process_tile_gpu(in0image, in1image, in0mean, in1mean, in0id, in1id, std::vector<ncnn::VkMat>(), outimage, opt);
     }
     else
     {
-#if _WIN32
-        in0 = ncnn::Mat::from_pixels(pixel0data, ncnn::Mat::PIXEL_BGR2RGB, w, h);
-        in1 = ncnn::Mat::from_pixels(pixel1data, ncnn::Mat::PIXEL_BGR2RGB, w, h);
-#else
-        in0 = ncnn::Mat::from_pixels(pixel0data, ncnn::Mat::PIXEL_RGB, w, h);
-        in1 = ncnn::Mat::from_pixels(pixel1data, ncnn::Mat::PIXEL_RGB, w, h);
-#endif
+        // channel attention statistics of the whole frame from a downscaled pass
+        // so that every tile scales its channels the same way and no seam shows up
+        std::vector<ncnn::VkMat> gap_stats;
+        {
+            ncnn::Mat in0small = downscale_pixels(in0image, tilesize);
+            ncnn::Mat in1small = downscale_pixels(in1image, tilesize);
+
+            extract_gap_gpu(in0small, in1small, in0mean, in1mean, gap_stats, opt);
+        }
+
+        const int xtiles = (w + tilesize - 1) / tilesize;
+        const int ytiles = (h + tilesize - 1) / tilesize;
+
+        for (int yi = 0; yi < ytiles; yi++)
+        {
+            const int y0 = yi * tilesize;
+            const int y1 = std::min(y0 + tilesize, h);
+            const int in_y0 = std::max(y0 - prepadding, 0);
+            const int in_y1 = std::min(y1 + prepadding, h);
+
+            for (int xi = 0; xi < xtiles; xi++)
+            {
+                const int x0 = xi * tilesize;
+                const int x1 = std::min(x0 + tilesize, w);
+                const int in_x0 = std::max(x0 - prepadding, 0);
+                const int in_x1 = std::min(x1 + prepadding, w);
+
+                ncnn::Mat in0tile = crop_pixels(in0image, in_x0, in_y0, in_x1 - in_x0, in_y1 - in_y0);
+                ncnn::Mat in1tile = crop_pixels(in1image, in_x0, in_y0, in_x1 - in_x0, in_y1 - in_y0);
+
+                ncnn::Mat outtile(in_x1 - in_x0, in_y1 - in_y0, (size_t)3u, 3);
+
+                // tiles are never shared between pairs, keep them out of the frame cache
+                process_tile_gpu(in0tile, in1tile, in0mean, in1mean, -1, -1, gap_stats, outtile, opt);
+
+                paste_pixels(outtile, x0 - in_x0, y0 - in_y0, outimage, x0, y0, x1 - x0, y1 - y0);
+            }
+        }
     }
 
+    reclaim_vkallocators(w, h, blob_vkallocator, staging_vkallocator);
+
+    return 0;
+}
+
+int CAIN::extract_gap_gpu(const ncnn::Mat& in0image, const ncnn::Mat& in1image, const float in0mean[3], const float in1mean[3], std::vector<ncnn::VkMat>& gap_stats, const ncnn::Option& opt) const
+{
+    const int w = in0image.w;
+    const int h = in0image.h;
+
+    // pad to the alignment of the graph
+    int w_padded = padded_size(w);
+    int h_padded = padded_size(h);
+
     ncnn::VkCompute cmd(vkdev);
 
-    // upload
-    ncnn::VkMat in0_gpu;
-    ncnn::VkMat in1_gpu;
-    {
-        cmd.record_clone(in0, in0_gpu, opt);
-        cmd.record_clone(in1, in1_gpu, opt);
-    }
+    ncnn::VkMat in0_gpu_reorg;
+    ncnn::VkMat in1_gpu_reorg;
+    preproc_gpu(in0image, in0mean, w_padded, h_padded, in0_gpu_reorg, cmd, opt);
+    preproc_gpu(in1image, in1mean, w_padded, h_padded, in1_gpu_reorg, cmd, opt);
 
-    // preproc
-    ncnn::VkMat in0_gpu_padded;
-    ncnn::VkMat in1_gpu_padded;
+    // cainnet up to the last pooling, the tail is never run
     {
-        in0_gpu_padded.create(w_padded, h_padded, 3, in_out_tile_elemsize, 1, blob_vkallocator);
+        ncnn::Extractor ex = cainnet.create_extractor();
+        ex.set_blob_vkallocator(opt.blob_vkallocator);
+        ex.set_workspace_vkallocator(opt.workspace_vkallocator);
+        ex.set_staging_vkallocator(opt.staging_vkallocator);
 
-        std::vector<ncnn::VkMat> bindings(2);
-        bindings[0] = in0_gpu;
-        bindings[1] = in0_gpu_padded;
+        ex.input(in0_reorg_blob, in0_gpu_reorg);
+        ex.input(in1_reorg_blob, in1_gpu_reorg);
 
-        std::vector<ncnn::vk_constant_type> constants(9);
-        constants[0].i = in0_gpu.w;
-        constants[1].i = in0_gpu.h;
-        constants[2].i = in0_gpu.cstep;
-        constants[3].i = in0_gpu_padded.w;
-        constants[4].i = in0_gpu_padded.h;
-        constants[5].i = in0_gpu_padded.cstep;
-#if _WIN32
-        constants[6].f = mean_rgb0[2];
-        constants[7].f = mean_rgb0[1];
-        constants[8].f = mean_rgb0[0];
-#else
-        constants[6].f = mean_rgb0[0];
-        constants[7].f = mean_rgb0[1];
-        constants[8].f = mean_rgb0[2];
-#endif
+        // save some memory
+        in0_gpu_reorg.release();
+        in1_gpu_reorg.release();
 
-        cmd.record_pipeline(cain_preproc, bindings, constants, in0_gpu_padded);
+        gap_stats.resize(gap_blobs.size());
+        for (size_t i = 0; i < gap_blobs.size(); i++)
+        {
+            ex.extract(gap_blobs[i], gap_stats[i], cmd);
+        }
     }
-    {
-        in1_gpu_padded.create(w_padded, h_padded, 3, in_out_tile_elemsize, 1, blob_vkallocator);
 
-        std::vector<ncnn::VkMat> bindings(2);
-        bindings[0] = in1_gpu;
-        bindings[1] = in1_gpu_padded;
+    cmd.submit_and_wait();
 
-        std::vector<ncnn::vk_constant_type> constants(9);
-        constants[0].i = in1_gpu.w;
-        constants[1].i = in1_gpu.h;
-        constants[2].i = in1_gpu.cstep;
-        constants[3].i = in1_gpu_padded.w;
-        constants[4].i = in1_gpu_padded.h;
-        constants[5].i = in1_gpu_padded.cstep;
-#if _WIN32
-        constants[6].f = mean_rgb1[2];
-        constants[7].f = mean_rgb1[1];
-        constants[8].f = mean_rgb1[0];
-#else
-        constants[6].f = mean_rgb1[0];
-        constants[7].f = mean_rgb1[1];
-        constants[8].f = mean_rgb1[2];
-#endif
+    return 0;
+}
 
-        cmd.record_pipeline(cain_preproc, bindings, constants, in1_gpu_padded);
-    }
+int CAIN::process_tile_gpu(const ncnn::Mat& in0image, const ncnn::Mat& in1image, const float in0mean[3], const float in1mean[3], int in0id, int in1id, const std::vector<ncnn::VkMat>& gap_stats, ncnn::Mat& outimage, const ncnn::Option& opt) const
+{
+    const int w = in0image.w;
+    const int h = in0image.h;
+    const int channels = 3;//in0image.elempack;
+
+    const float* mean_rgb0 = in0mean;
+    const float* mean_rgb1 = in1mean;
+
+    // pad to the alignment of the graph
+    int w_padded = padded_size(w);
+    int h_padded = padded_size(h);
+
+    ncnn::VkCompute cmd(vkdev);
+
+    // upload, preproc and space-to-depth, shared with the neighbour pairs
+    ncnn::VkMat in0_gpu_reorg;
+    ncnn::VkMat in1_gpu_reorg;
+    preproc_gpu_cached(in0image, mean_rgb0, in0id, w_padded, h_padded, in0_gpu_reorg, cmd, opt);
+    preproc_gpu_cached(in1image, mean_rgb1, in1id, w_padded, h_padded, in1_gpu_reorg, cmd, opt);
 
     // cainnet
     ncnn::VkMat out_gpu_padded;
     {
         ncnn::Extractor ex = cainnet.create_extractor();
-        ex.set_blob_vkallocator(blob_vkallocator);
-        ex.set_workspace_vkallocator(blob_vkallocator);
-        ex.set_staging_vkallocator(staging_vkallocator);
+        ex.set_blob_vkallocator(opt.blob_vkallocator);
+        ex.set_workspace_vkallocator(opt.workspace_vkallocator);
+        ex.set_staging_vkallocator(opt.staging_vkallocator);
 
-        ex.input("x.1", in0_gpu_padded);
-        ex.input("x.3", in1_gpu_padded);
+        ex.input(in0_reorg_blob, in0_gpu_reorg);
+        ex.input(in1_reorg_blob, in1_gpu_reorg);
+
+        // frame-level statistics replace the per-tile GlobalAveragePool
+        for (size_t i = 0; i < gap_stats.size(); i++)
+        {
+            ex.input(gap_blobs[i], gap_stats[i]);
+        }
 
         // save some memory
-        in0_gpu_padded.release();
-        in1_gpu_padded.release();
+        in0_gpu_reorg.release();
+        in1_gpu_reorg.release();
+
+        cain_set_gap_stats_fed(!gap_stats.empty());
 
-        ex.extract("4070", out_gpu_padded, cmd);
+        ex.extract(out_blob, out_gpu_padded, cmd);
+
+        cain_set_gap_stats_fed(0);
     }
 
     ncnn::VkMat out_gpu;
     if (opt.use_fp16_storage && opt.use_int8_storage)
     {
-        out_gpu.create(w, h, (size_t)channels, 1, blob_vkallocator);
+        out_gpu.create(w, h, (size_t)channels, 1, opt.blob_vkallocator);
     }
     else
     {
-        out_gpu.create(w, h, channels, (size_t)4u, 1, blob_vkallocator);
+        out_gpu.create(w, h, channels, (size_t)4u, 1, opt.blob_vkallocator);
     }
 
     // postproc
@@ -363,8 +1440,204 @@ int CAIN::process(const ncnn::Mat& in0image, const ncnn::Mat& in1image, float ti
         }
     }
 
-    vkdev->reclaim_blob_allocator(blob_vkallocator);
-    vkdev->reclaim_staging_allocator(staging_vkallocator);
+    return 0;
+}
+
+int CAIN::process_cpu(const ncnn::Mat& in0image, const ncnn::Mat& in1image, const float in0mean[3], const float in1mean[3], int in0id, int in1id, float timestep, ncnn::Mat& outimage) const
+{
+    if (timestep == 0.f)
+    {
+        outimage = in0image;
+        return 0;
+    }
+
+    if (timestep == 1.f)
+    {
+        outimage = in1image;
+        return 0;
+    }
+
+    const int w = in0image.w;
+    const int h = in0image.h;
+
+//     fprintf(stderr, "%d x %d\n", w, h);
+
+    ncnn::Option opt = cainnet.opt;
+
+    if (tilesize <= 0 || (w <= tilesize && h <= tilesize))
+    {
+        // whole frame at once
+        process_tile_cpu(in0image, in1image, in0mean, in1mean, in0id, in1id, std::vector<ncnn::Mat>(), outimage, opt);
+    }
+    else
+    {
+        // channel attention statistics of the whole frame from a downscaled pass
+        // so that every tile scales its channels the same way and no seam shows up
+        std::vector<ncnn::Mat> gap_stats;
+        {
+            ncnn::Mat in0small = downscale_pixels(in0image, tilesize);
+            ncnn::Mat in1small = downscale_pixels(in1image, tilesize);
+
+            extract_gap_cpu(in0small, in1small, in0mean, in1mean, gap_stats, opt);
+        }
+
+        const int xtiles = (w + tilesize - 1) / tilesize;
+        const int ytiles = (h + tilesize - 1) / tilesize;
+
+        for (int yi = 0; yi < ytiles; yi++)
+        {
+            const int y0 = yi * tilesize;
+            const int y1 = std::min(y0 + tilesize, h);
+            const int in_y0 = std::max(y0 - prepadding, 0);
+            const int in_y1 = std::min(y1 + prepadding, h);
+
+            for (int xi = 0; xi < xtiles; xi++)
+            {
+                const int x0 = xi * tilesize;
+                const int x1 = std::min(x0 + tilesize, w);
+                const int in_x0 = std::max(x0 - prepadding, 0);
+                const int in_x1 = std::min(x1 + prepadding, w);
+
+                ncnn::Mat in0tile = crop_pixels(in0image, in_x0, in_y0, in_x1 - in_x0, in_y1 - in_y0);
+                ncnn::Mat in1tile = crop_pixels(in1image, in_x0, in_y0, in_x1 - in_x0, in_y1 - in_y0);
+
+                ncnn::Mat outtile(in_x1 - in_x0, in_y1 - in_y0, (size_t)3u, 3);
+
+                // tiles are never shared between pairs, keep them out of the frame cache
+                process_tile_cpu(in0tile, in1tile, in0mean, in1mean, -1, -1, gap_stats, outtile, opt);
+
+                paste_pixels(outtile, x0 - in_x0, y0 - in_y0, outimage, x0, y0, x1 - x0, y1 - y0);
+            }
+        }
+    }
+
+    return 0;
+}
+
+int CAIN::extract_gap_cpu(const ncnn::Mat& in0image, const ncnn::Mat& in1image, const float in0mean[3], const float in1mean[3], std::vector<ncnn::Mat>& gap_stats, const ncnn::Option& opt) const
+{
+    const int w = in0image.w;
+    const int h = in0image.h;
+
+    // pad to the alignment of the graph
+    int w_padded = padded_size(w);
+    int h_padded = padded_size(h);
+
+    ncnn::Mat in0_reorg;
+    ncnn::Mat in1_reorg;
+    preproc_cpu(in0image, in0mean, w_padded, h_padded, in0_reorg, opt);
+    preproc_cpu(in1image, in1mean, w_padded, h_padded, in1_reorg, opt);
+
+    CAINArenaAllocator* allocator = acquire_arena_allocator(w_padded, h_padded, CAIN_PATH_GAP);
+
+    // cainnet up to the last pooling, the tail is never run
+    {
+        ncnn::Extractor ex = cainnet.create_extractor();
+        ex.set_blob_allocator(allocator);
+        ex.set_workspace_allocator(allocator);
+
+        ex.input(in0_reorg_blob, in0_reorg);
+        ex.input(in1_reorg_blob, in1_reorg);
+
+        // save some memory
+        in0_reorg.release();
+        in1_reorg.release();
+
+        // keep the packed layout, they go straight back into the same layers
+        gap_stats.resize(gap_blobs.size());
+        for (size_t i = 0; i < gap_blobs.size(); i++)
+        {
+            ex.extract(gap_blobs[i], gap_stats[i], 1);
+        }
+    }
+
+    // the statistics outlive the pass, they are never placed in the arena
+    reclaim_arena_allocator(allocator, w_padded, h_padded, CAIN_PATH_GAP);
+
+    return 0;
+}
+
+int CAIN::process_tile_cpu(const ncnn::Mat& in0image, const ncnn::Mat& in1image, const float in0mean[3], const float in1mean[3], int in0id, int in1id, const std::vector<ncnn::Mat>& gap_stats, ncnn::Mat& outimage, const ncnn::Option& opt) const
+{
+    const int w = in0image.w;
+    const int h = in0image.h;
+    const int channels = 3;//in0image.elempack;
+
+    const float* mean_rgb0 = in0mean;
+    const float* mean_rgb1 = in1mean;
+
+    // pad to the alignment of the graph
+    int w_padded = padded_size(w);
+    int h_padded = padded_size(h);
+
+    // preproc and space-to-depth, shared with the neighbour pairs
+    ncnn::Mat in0_reorg;
+    ncnn::Mat in1_reorg;
+    preproc_cpu_cached(in0image, mean_rgb0, in0id, w_padded, h_padded, in0_reorg, opt);
+    preproc_cpu_cached(in1image, mean_rgb1, in1id, w_padded, h_padded, in1_reorg, opt);
+
+    // every intermediate blob comes from one arena once this size has been planned
+    const int path = gap_stats.empty() ? CAIN_PATH_FRAME : CAIN_PATH_TILE;
+    CAINArenaAllocator* allocator = acquire_arena_allocator(w_padded, h_padded, path);
+
+    // cainnet
+    ncnn::Mat out_reorg;
+    {
+        ncnn::Extractor ex = cainnet.create_extractor();
+        ex.set_blob_allocator(allocator);
+        ex.set_workspace_allocator(allocator);
+
+        ex.input(in0_reorg_blob, in0_reorg);
+        ex.input(in1_reorg_blob, in1_reorg);
+
+        // frame-level statistics replace the per-tile GlobalAveragePool
+        for (size_t i = 0; i < gap_stats.size(); i++)
+        {
+            ex.input(gap_blobs[i], gap_stats[i]);
+        }
+
+        // save some memory
+        in0_reorg.release();
+        in1_reorg.release();
+
+        cain_set_gap_stats_fed(!gap_stats.empty());
+
+        // stop before Reshape_2409 and keep the packed layout
+        ex.extract(out_reorg_blob, out_reorg, 1);
+
+        if (out_reorg.elembits() != 32)
+        {
+            // fp16 or bf16 storage, let ncnn cast it back
+            ex.extract(out_reorg_blob, out_reorg);
+        }
+
+        cain_set_gap_stats_fed(0);
+    }
+
+    // postproc, pixel shuffle, crop and interleave in one pass
+    {
+#if _WIN32
+        const int bgr = 1;
+#else
+        const int bgr = 0;
+#endif
+
+        float mean_rgb_ordered[3];
+        for (int q = 0; q < channels; q++)
+        {
+#if _WIN32
+            mean_rgb_ordered[q] = (mean_rgb0[2 - q] + mean_rgb1[2 - q]) / 2.f;
+#else
+            mean_rgb_ordered[q] = (mean_rgb0[q] + mean_rgb1[q]) / 2.f;
+#endif
+        }
+
+        cain_postproc_shuffle(out_reorg, reorg_stride, mean_rgb_ordered, bgr, (unsigned char*)outimage.data, w, h, opt);
+    }
+
+    out_reorg.release();
+
+    reclaim_arena_allocator(allocator, w_padded, h_padded, path);
 
     return 0;
 }
@@ -3,15 +3,31 @@
 #ifndef CAIN_H
 #define CAIN_H
 
+#include <map>
 #include <string>
+#include <vector>
 
 // ncnn
 #include "net.h"
 
+// cpu feature map precision
+enum
+{
+    CAIN_PRECISION_FP32 = 0,
+    CAIN_PRECISION_FP16 = 1,
+    CAIN_PRECISION_BF16 = 2,
+    CAIN_PRECISION_AUTO = 3
+};
+
+class CAINModelData;
+class CAINMemoryPlan;
+class CAINExecutionPlan;
+class CAINArenaAllocator;
+
 class CAIN
 {
 public:
-    CAIN(int gpuid);
+    CAIN(int gpuid, int num_threads = 1);
     ~CAIN();
 
 #if _WIN32
@@ -20,13 +36,98 @@ public:
     int load(const std::string& modeldir);
 #endif
 
-    int process(const ncnn::Mat& in0image, const ncnn::Mat& in1image, float timestep, ncnn::Mat& outimage) const;
+    // in0mean and in1mean are the per-channel pixel means from cain_image_mean
+    // in0id and in1id identify the input frames, the preprocessed tensor of a frame with id >= 0
+    // is kept until release_frame(id) so that the adjacent pair sharing it skips the work
+    int process(const ncnn::Mat& in0image, const ncnn::Mat& in1image, const float in0mean[3], const float in1mean[3], int in0id, int in1id, float timestep, ncnn::Mat& outimage) const;
+
+    int process_cpu(const ncnn::Mat& in0image, const ncnn::Mat& in1image, const float in0mean[3], const float in1mean[3], int in0id, int in1id, float timestep, ncnn::Mat& outimage) const;
+
+    // drop the cached tensor once the last pair using frame id is done
+    void release_frame(int id) const;
+
+    // frames of the same bucket share one execution plan, a scheduler that keeps them together avoids setup work
+    unsigned long long bucket(int w, int h) const;
+
+public:
+    // directory for compiled shaders reused across runs, empty to disable
+#if _WIN32
+    std::wstring cachedir;
+#else
+    std::string cachedir;
+#endif
+    // frames larger than tilesize run tile by tile, 0 for whole frame
+    int tilesize;
+    // halo of input pixels around each tile
+    int prepadding;
+    // cpu only, benchmark the convolution algorithms for frames of this size at load and keep the fastest
+    // with tilesize set before load the benchmark runs on the map of one tile pass
+    // the choice is remembered in cachedir, 0 keeps ncnn's own choice
+    int autotune_width;
+    int autotune_height;
+    // cpu only, load cain-int8.param and cain-int8.bin from cain-calibrate and ncnn2int8
+    // the calibrated convolutions run in int8
+    int use_int8;
+    // cpu only, CAIN_PRECISION_*, 16-bit feature maps halve the memory traffic of the wide convolutions
+    // auto takes fp16 on arm cpus computing in fp16, then bf16 on arm cpus with bf16 dot products, fp32 on x86
+    int precision;
+
+private:
+    int process_tile_gpu(const ncnn::Mat& in0image, const ncnn::Mat& in1image, const float in0mean[3], const float in1mean[3], int in0id, int in1id, const std::vector<ncnn::VkMat>& gap_stats, ncnn::Mat& outimage, const ncnn::Option& opt) const;
+    int process_tile_cpu(const ncnn::Mat& in0image, const ncnn::Mat& in1image, const float in0mean[3], const float in1mean[3], int in0id, int in1id, const std::vector<ncnn::Mat>& gap_stats, ncnn::Mat& outimage, const ncnn::Option& opt) const;
+    int extract_gap_gpu(const ncnn::Mat& in0image, const ncnn::Mat& in1image, const float in0mean[3], const float in1mean[3], std::vector<ncnn::VkMat>& gap_stats, const ncnn::Option& opt) const;
+    int extract_gap_cpu(const ncnn::Mat& in0image, const ncnn::Mat& in1image, const float in0mean[3], const float in1mean[3], std::vector<ncnn::Mat>& gap_stats, const ncnn::Option& opt) const;
+
+    int preproc_gpu(const ncnn::Mat& image, const float mean_rgb[3], int w_padded, int h_padded, ncnn::VkMat& out_gpu_reorg, ncnn::VkCompute& cmd, const ncnn::Option& opt) const;
+    int preproc_gpu_cached(const ncnn::Mat& image, const float mean_rgb[3], int id, int w_padded, int h_padded, ncnn::VkMat& out_gpu_reorg, ncnn::VkCompute& cmd, const ncnn::Option& opt) const;
+    void preproc_cpu(const ncnn::Mat& image, const float mean_rgb[3], int w_padded, int h_padded, ncnn::Mat& out_reorg, const ncnn::Option& opt) const;
+    void preproc_cpu_cached(const ncnn::Mat& image, const float mean_rgb[3], int id, int w_padded, int h_padded, ncnn::Mat& out_reorg, const ncnn::Option& opt) const;
+
+    void autotune_convolution(const std::vector<ncnn::ParamDict>& params);
+
+    // size aligned to the strides of the graph, never below two elements of the smallest feature map
+    int padded_size(int size) const;
+
+    // created on first use, execution_plan_lock must be held
+    CAINExecutionPlan* find_execution_plan(int w_padded, int h_padded) const;
+
+    // cpu extractor allocator, planned after the first pass of each input size and graph path
+    CAINArenaAllocator* acquire_arena_allocator(int w_padded, int h_padded, int path) const;
+    void reclaim_arena_allocator(CAINArenaAllocator* allocator, int w_padded, int h_padded, int path) const;
+
+    // gpu blob and staging allocators kept per input size of w x h frames
+    void acquire_vkallocators(int w, int h, ncnn::VkAllocator** blob_vkallocator, ncnn::VkAllocator** staging_vkallocator) const;
+    void reclaim_vkallocators(int w, int h, ncnn::VkAllocator* blob_vkallocator, ncnn::VkAllocator* staging_vkallocator) const;
 
 private:
     ncnn::VulkanDevice* vkdev;
     ncnn::Net cainnet;
     ncnn::Pipeline* cain_preproc;
     ncnn::Pipeline* cain_postproc;
+    int num_threads;
+    CAINModelData* model_data;
+    int in_blob;
+    int in0_reorg_blob;
+    int in1_reorg_blob;
+    int out_reorg_blob;
+    int out_blob;
+    std::vector<int> gap_blobs;
+    // space-to-depth stride of the input Reorg and the size the padded input must be a multiple of
+    int reorg_stride;
+    int padding_alignment;
+    int max_channels;
+
+    // preprocessed and space-to-depth input tensors by source frame id
+    mutable ncnn::Mutex frame_cache_lock;
+    mutable std::map<int, ncnn::Mat> frame_cache;
+    mutable std::map<int, ncnn::VkMat> frame_cache_gpu;
+    // locks itself, the cached tensors are released from whichever thread drops them last
+    ncnn::VkAllocator* frame_cache_vkallocator;
+
+    // execution plans by padded input size, idle arena allocators
+    mutable ncnn::Mutex execution_plan_lock;
+    mutable std::map<unsigned long long, CAINExecutionPlan*> execution_plans;
+    mutable std::vector<CAINArenaAllocator*> arena_allocators;
 };
 
 #endif // CAIN_H
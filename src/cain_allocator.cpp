@@ -0,0 +1,263 @@
+// cain implemented with ncnn library
+
+#include "cain_allocator.h"
+
+#include <algorithm>
+
+static const size_t NOT_PLANNED = (size_t)-1;
+
+static size_t align_arena_size(size_t size)
+{
+    return (size + 63) & ~(size_t)63;
+}
+
+CAINMemoryPlan::CAINMemoryPlan()
+{
+    arena_size = 0;
+}
+
+CAINArenaAllocator::CAINArenaAllocator()
+{
+    plan = 0;
+    recording = 0;
+
+    arena = 0;
+    arena_capacity = 0;
+
+    clock = 0;
+}
+
+CAINArenaAllocator::~CAINArenaAllocator()
+{
+    ncnn::fastFree(arena);
+}
+
+void CAINArenaAllocator::begin(const CAINMemoryPlan* _plan)
+{
+    ncnn::MutexLockGuard guard(lock);
+
+    plan = _plan;
+    recording = plan ? 0 : 1;
+
+    if (plan && plan->arena_size > arena_capacity)
+    {
+        ncnn::fastFree(arena);
+        arena = (unsigned char*)ncnn::fastMalloc(plan->arena_size);
+        arena_capacity = arena ? plan->arena_size : 0;
+    }
+
+    clock = 0;
+    sizes.clear();
+    starts.clear();
+    ends.clear();
+}
+
+struct size_greater
+{
+    const std::vector<size_t>& sizes;
+
+    size_greater(const std::vector<size_t>& _sizes)
+        : sizes(_sizes)
+    {
+    }
+
+    bool operator()(size_t a, size_t b) const
+    {
+        return sizes[a] > sizes[b];
+    }
+};
+
+static bool lifetime_overlap(size_t start0, size_t end0, size_t start1, size_t end1)
+{
+    return start0 < end1 && start1 < end0;
+}
+
+int CAINArenaAllocator::end(CAINMemoryPlan& _plan)
+{
+    ncnn::MutexLockGuard guard(lock);
+
+    const int recorded = recording;
+
+    if (recording)
+    {
+        const size_t count = sizes.size();
+
+        _plan.sizes = sizes;
+        _plan.offsets.assign(count, NOT_PLANNED);
+        _plan.arena_size = 0;
+
+        // largest first, each at the lowest offset that does not collide with a placed allocation alive at the same time
+        std::vector<size_t> order;
+        for (size_t i = 0; i < count; i++)
+        {
+            // still alive, it outlives the pass and must not live in the arena
+            if (ends[i] == NOT_PLANNED)
+                continue;
+
+            order.push_back(i);
+        }
+
+        std::stable_sort(order.begin(), order.end(), size_greater(sizes));
+
+        std::vector<size_t> placed;
+        for (size_t k = 0; k < order.size(); k++)
+        {
+            const size_t i = order[k];
+            const size_t size = align_arena_size(sizes[i]);
+
+            std::vector<std::pair<size_t, size_t> > taken;
+            for (size_t p = 0; p < placed.size(); p++)
+            {
+                const size_t j = placed[p];
+                if (lifetime_overlap(starts[i], ends[i], starts[j], ends[j]))
+                {
+                    taken.push_back(std::make_pair(_plan.offsets[j], _plan.offsets[j] + align_arena_size(sizes[j])));
+                }
+            }
+
+            std::sort(taken.begin(), taken.end());
+
+            size_t offset = 0;
+            for (size_t t = 0; t < taken.size(); t++)
+            {
+                if (offset + size <= taken[t].first)
+                    break;
+
+                offset = std::max(offset, taken[t].second);
+            }
+
+            _plan.offsets[i] = offset;
+            _plan.arena_size = std::max(_plan.arena_size, offset + size);
+
+            placed.push_back(i);
+        }
+    }
+
+    plan = 0;
+    recording = 0;
+
+    // whatever is left outlived the pass, it was malloc'ed and is freed by pointer later
+    live.clear();
+
+    return recorded ? 0 : -1;
+}
+
+void* CAINArenaAllocator::fastMalloc(size_t size)
+{
+    ncnn::MutexLockGuard guard(lock);
+
+    const size_t index = sizes.size();
+    sizes.push_back(size);
+
+    if (recording)
+    {
+        void* ptr = ncnn::fastMalloc(size);
+
+        starts.push_back(clock++);
+        ends.push_back(NOT_PLANNED);
+
+        live.push_back(std::make_pair(ptr, index));
+        return ptr;
+    }
+
+    if (plan && index < plan->sizes.size() && plan->sizes[index] == size && plan->offsets[index] != NOT_PLANNED)
+    {
+        const size_t offset = plan->offsets[index];
+        const size_t end = offset + align_arena_size(size);
+
+        // the pass should follow the recorded order exactly, fall back to malloc rather than alias a live block
+        bool collide = false;
+        for (size_t i = 0; i < live.size(); i++)
+        {
+            const unsigned char* p = (const unsigned char*)live[i].first;
+            if (p < arena || p >= arena + arena_capacity)
+                continue;
+
+            const size_t live_offset = p - arena;
+            const size_t live_end = live_offset + align_arena_size(sizes[live[i].second]);
+            if (offset < live_end && live_offset < end)
+            {
+                collide = true;
+                break;
+            }
+        }
+
+        if (!collide)
+        {
+            void* ptr = arena + offset;
+            live.push_back(std::make_pair(ptr, index));
+            return ptr;
+        }
+    }
+
+    void* ptr = ncnn::fastMalloc(size);
+    live.push_back(std::make_pair(ptr, index));
+    return ptr;
+}
+
+void CAINArenaAllocator::fastFree(void* ptr)
+{
+    ncnn::MutexLockGuard guard(lock);
+
+    // a few dozen blobs are alive at most, a linear scan beats a map that would allocate per node
+    for (size_t i = 0; i < live.size(); i++)
+    {
+        if (live[i].first != ptr)
+            continue;
+
+        if (recording)
+        {
+            ends[live[i].second] = clock++;
+        }
+
+        live[i] = live.back();
+        live.pop_back();
+        break;
+    }
+
+    const unsigned char* p = (const unsigned char*)ptr;
+    if (p >= arena && p < arena + arena_capacity)
+        return;
+
+    ncnn::fastFree(ptr);
+}
+
+CAINLockedVkBlobAllocator::CAINLockedVkBlobAllocator(const ncnn::VulkanDevice* _vkdev)
+    : ncnn::VkBlobAllocator(_vkdev)
+{
+}
+
+void CAINLockedVkBlobAllocator::clear()
+{
+    ncnn::MutexLockGuard guard(lock);
+
+    ncnn::VkBlobAllocator::clear();
+}
+
+ncnn::VkBufferMemory* CAINLockedVkBlobAllocator::fastMalloc(size_t size)
+{
+    ncnn::MutexLockGuard guard(lock);
+
+    return ncnn::VkBlobAllocator::fastMalloc(size);
+}
+
+void CAINLockedVkBlobAllocator::fastFree(ncnn::VkBufferMemory* ptr)
+{
+    ncnn::MutexLockGuard guard(lock);
+
+    ncnn::VkBlobAllocator::fastFree(ptr);
+}
+
+ncnn::VkImageMemory* CAINLockedVkBlobAllocator::fastMalloc(int w, int h, int c, size_t elemsize, int elempack)
+{
+    ncnn::MutexLockGuard guard(lock);
+
+    return ncnn::VkBlobAllocator::fastMalloc(w, h, c, elemsize, elempack);
+}
+
+void CAINLockedVkBlobAllocator::fastFree(ncnn::VkImageMemory* ptr)
+{
+    ncnn::MutexLockGuard guard(lock);
+
+    ncnn::VkBlobAllocator::fastFree(ptr);
+}
@@ -0,0 +1,90 @@
+// cain implemented with ncnn library
+
+#ifndef CAIN_ALLOCATOR_H
+#define CAIN_ALLOCATOR_H
+
+#include <stddef.h>
+#include <utility>
+#include <vector>
+
+// ncnn
+#include "allocator.h"
+#include "platform.h"
+
+// static placement of every blob and workspace allocation of one forward pass
+// the i-th allocation of the pass lives at offsets[i] in the arena, or is not planned when it outlives the pass
+class CAINMemoryPlan
+{
+public:
+    CAINMemoryPlan();
+
+    std::vector<size_t> sizes;
+    std::vector<size_t> offsets;
+
+    size_t arena_size;
+};
+
+// allocator for one extractor at a time
+// without a plan it records the allocation order and lifetimes of the pass
+// with a plan it hands out arena offsets in the recorded order and never calls malloc
+class CAINArenaAllocator : public ncnn::Allocator
+{
+public:
+    CAINArenaAllocator();
+    virtual ~CAINArenaAllocator();
+
+    // plan 0 records a new one
+    void begin(const CAINMemoryPlan* plan);
+
+    // all pass-local allocations must be freed by now
+    // returns 0 and fills plan when a pass was recorded
+    int end(CAINMemoryPlan& plan);
+
+    virtual void* fastMalloc(size_t size);
+    virtual void fastFree(void* ptr);
+
+private:
+    CAINArenaAllocator(const CAINArenaAllocator&);
+    CAINArenaAllocator& operator=(const CAINArenaAllocator&);
+
+    ncnn::Mutex lock;
+
+    const CAINMemoryPlan* plan;
+    int recording;
+
+    unsigned char* arena;
+    size_t arena_capacity;
+
+    // allocation order, counts mallocs and frees
+    size_t clock;
+    std::vector<size_t> sizes;
+    std::vector<size_t> starts;
+    std::vector<size_t> ends;
+
+    // live allocations, pointer and index
+    // all vectors keep their capacity across passes so that a planned pass allocates nothing
+    std::vector<std::pair<void*, size_t> > live;
+};
+
+// blob allocator that may be shared across threads
+// VkBlobAllocator itself is not thread-safe, and the last reference to a VkMat can drop on any thread
+class CAINLockedVkBlobAllocator : public ncnn::VkBlobAllocator
+{
+public:
+    CAINLockedVkBlobAllocator(const ncnn::VulkanDevice* vkdev);
+
+    virtual void clear();
+
+    virtual ncnn::VkBufferMemory* fastMalloc(size_t size);
+    virtual void fastFree(ncnn::VkBufferMemory* ptr);
+    virtual ncnn::VkImageMemory* fastMalloc(int w, int h, int c, size_t elemsize, int elempack);
+    virtual void fastFree(ncnn::VkImageMemory* ptr);
+
+private:
+    CAINLockedVkBlobAllocator(const CAINLockedVkBlobAllocator&);
+    CAINLockedVkBlobAllocator& operator=(const CAINLockedVkBlobAllocator&);
+
+    ncnn::Mutex lock;
+};
+
+#endif // CAIN_ALLOCATOR_H
@@ -0,0 +1,130 @@
+// cain implemented with ncnn library
+
+#include "cain_autotune.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// ncnn
+#include "benchmark.h"
+#include "datareader.h"
+#include "net.h"
+
+static const char* algorithm_names[CAIN_CONV_ALGORITHM_COUNT] = {
+    "default",
+    "winograd63",
+    "winograd43",
+    "winograd23",
+    "sgemm",
+    "direct"
+};
+
+const char* cain_convolution_algorithm_name(int algorithm)
+{
+    if (algorithm < 0 || algorithm >= CAIN_CONV_ALGORITHM_COUNT)
+        return algorithm_names[CAIN_CONV_DEFAULT];
+
+    return algorithm_names[algorithm];
+}
+
+int cain_convolution_algorithm_from_name(const char* name)
+{
+    for (int i = 0; i < CAIN_CONV_ALGORITHM_COUNT; i++)
+    {
+        if (strcmp(name, algorithm_names[i]) == 0)
+            return i;
+    }
+
+    return CAIN_CONV_DEFAULT;
+}
+
+void cain_set_convolution_algorithm(ncnn::Option& opt, int algorithm)
+{
+    if (algorithm == CAIN_CONV_DEFAULT)
+        return;
+
+    // ncnn picks winograd over sgemm whenever it is allowed, so a single enabled variant forces it
+    opt.use_winograd_convolution = algorithm == CAIN_CONV_WINOGRAD63 || algorithm == CAIN_CONV_WINOGRAD43 || algorithm == CAIN_CONV_WINOGRAD23;
+    opt.use_winograd63_convolution = algorithm == CAIN_CONV_WINOGRAD63;
+    opt.use_winograd43_convolution = algorithm == CAIN_CONV_WINOGRAD43;
+    opt.use_winograd23_convolution = algorithm == CAIN_CONV_WINOGRAD23;
+    opt.use_sgemm_convolution = algorithm != CAIN_CONV_DIRECT;
+}
+
+// every weight reads as zero
+class DataReaderFromZeros : public ncnn::DataReader
+{
+public:
+    virtual size_t read(void* buf, size_t size) const
+    {
+        memset(buf, 0, size);
+        return size;
+    }
+};
+
+int cain_autotune_convolution(const ncnn::ParamDict& pd, int w, int h, const ncnn::Option& opt)
+{
+    const int num_output = pd.get(0, 0);
+    const int kernel_w = pd.get(1, 0);
+    const int kernel_h = pd.get(11, kernel_w);
+    const int pad_left = pd.get(4, 0);
+    const int bias_term = pd.get(5, 0);
+    const int weight_data_size = pd.get(6, 0);
+
+    if (num_output <= 0 || kernel_w <= 0 || kernel_h <= 0 || weight_data_size % (num_output * kernel_w * kernel_h) != 0)
+        return CAIN_CONV_DEFAULT;
+
+    const int channels = weight_data_size / (num_output * kernel_w * kernel_h);
+
+    // the graph pads with a separate layer, the convolution sees the border as input
+    const int inw = pad_left > 0 ? w : w + kernel_w - 1;
+    const int inh = pad_left > 0 ? h : h + kernel_h - 1;
+
+    char param[512];
+    sprintf(param, "7767517\n2 2\nInput input 0 1 input 0=%d 1=%d 2=%d\nConvolution conv 1 1 input output 0=%d 1=%d 11=%d 4=%d 5=%d 6=%d\n", inw, inh, channels, num_output, kernel_w, kernel_h, pad_left, bias_term, weight_data_size);
+
+    ncnn::Mat in(inw, inh, channels);
+    in.fill(0.5f);
+
+    int best_algorithm = CAIN_CONV_DEFAULT;
+    double best_time = 0;
+
+    for (int algorithm = CAIN_CONV_WINOGRAD63; algorithm < CAIN_CONV_ALGORITHM_COUNT; algorithm++)
+    {
+        ncnn::Net net;
+        net.opt = opt;
+        cain_set_convolution_algorithm(net.opt, algorithm);
+
+        if (net.load_param_mem(param) != 0)
+            return CAIN_CONV_DEFAULT;
+
+        DataReaderFromZeros dr;
+        net.load_model(dr);
+
+        // one warm up, then the best of three
+        double algorithm_time = 0;
+        for (int i = 0; i < 4; i++)
+        {
+            ncnn::Extractor ex = net.create_extractor();
+            ex.input(0, in);
+
+            double start = ncnn::get_current_time();
+
+            ncnn::Mat out;
+            ex.extract(1, out);
+
+            double end = ncnn::get_current_time();
+
+            if (i == 1 || (i > 1 && end - start < algorithm_time))
+                algorithm_time = end - start;
+        }
+
+        if (best_algorithm == CAIN_CONV_DEFAULT || algorithm_time < best_time)
+        {
+            best_algorithm = algorithm;
+            best_time = algorithm_time;
+        }
+    }
+
+    return best_algorithm;
+}
@@ -0,0 +1,34 @@
+// cain implemented with ncnn library
+
+#ifndef CAIN_AUTOTUNE_H
+#define CAIN_AUTOTUNE_H
+
+// ncnn
+#include "option.h"
+#include "paramdict.h"
+
+// cpu convolution algorithms ncnn can be steered to through the net option
+enum
+{
+    CAIN_CONV_DEFAULT = 0,
+    CAIN_CONV_WINOGRAD63 = 1,
+    CAIN_CONV_WINOGRAD43 = 2,
+    CAIN_CONV_WINOGRAD23 = 3,
+    CAIN_CONV_SGEMM = 4,
+    CAIN_CONV_DIRECT = 5,
+    CAIN_CONV_ALGORITHM_COUNT = 6
+};
+
+const char* cain_convolution_algorithm_name(int algorithm);
+
+// CAIN_CONV_DEFAULT for an unknown name
+int cain_convolution_algorithm_from_name(const char* name);
+
+// set before load_model, the weights are transformed for the chosen algorithm when the pipeline is created
+void cain_set_convolution_algorithm(ncnn::Option& opt, int algorithm);
+
+// time every algorithm on a single convolution with the params pd and an output of w x h
+// on zero weights, the convolution cost does not depend on the values, returns the fastest
+int cain_autotune_convolution(const ncnn::ParamDict& pd, int w, int h, const ncnn::Option& opt);
+
+#endif // CAIN_AUTOTUNE_H
@@ -0,0 +1,143 @@
+// cain implemented with ncnn library
+
+#include "cain_cache.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#if _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+// ncnn
+#include "platform.h"
+
+unsigned long long cain_cache_hash(unsigned long long hash, const void* data, size_t size)
+{
+    const unsigned char* p = (const unsigned char*)data;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+// only the file name goes through a fixed buffer, name and ext are ours and short
+#if _WIN32
+std::wstring cain_cache_path(const std::wstring& cachedir, const char* name, unsigned long long hash, const char* ext)
+{
+    wchar_t filename[128];
+    swprintf(filename, 128, L"%hs-%016llx.%hs", name, hash, ext);
+    return cachedir + L"/" + filename;
+}
+
+std::wstring cain_cache_temp_path(const std::wstring& path)
+{
+    wchar_t suffix[32];
+    swprintf(suffix, 32, L".%lu.tmp", (unsigned long)GetCurrentProcessId());
+    return path + suffix;
+}
+#else
+std::string cain_cache_path(const std::string& cachedir, const char* name, unsigned long long hash, const char* ext)
+{
+    char filename[128];
+    snprintf(filename, sizeof(filename), "%s-%016llx.%s", name, hash, ext);
+    return cachedir + "/" + filename;
+}
+
+std::string cain_cache_temp_path(const std::string& path)
+{
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".%lu.tmp", (unsigned long)getpid());
+    return path + suffix;
+}
+#endif
+
+#if _WIN32
+void cain_compile_spirv_module_cached(const char* comp_data, int comp_data_size, const char* name, const ncnn::Option& opt, const ncnn::VulkanDevice* vkdev, const std::wstring& cachedir, std::vector<uint32_t>& spirv)
+#else
+void cain_compile_spirv_module_cached(const char* comp_data, int comp_data_size, const char* name, const ncnn::Option& opt, const ncnn::VulkanDevice* vkdev, const std::string& cachedir, std::vector<uint32_t>& spirv)
+#endif
+{
+    if (cachedir.empty())
+    {
+        compile_spirv_module(comp_data, comp_data_size, opt, spirv);
+        return;
+    }
+
+    unsigned long long hash = CAIN_CACHE_HASH_INIT;
+    {
+        const unsigned int driver_version = vkdev->info.driver_version();
+        const int flags[6] = {
+            opt.use_fp16_packed,
+            opt.use_fp16_storage,
+            opt.use_fp16_arithmetic,
+            opt.use_int8_storage,
+            opt.use_int8_arithmetic,
+            opt.use_shader_local_memory
+        };
+
+        hash = cain_cache_hash(hash, comp_data, comp_data_size);
+        hash = cain_cache_hash(hash, vkdev->info.pipeline_cache_uuid(), VK_UUID_SIZE);
+        hash = cain_cache_hash(hash, &driver_version, sizeof(driver_version));
+        hash = cain_cache_hash(hash, flags, sizeof(flags));
+        hash = cain_cache_hash(hash, NCNN_VERSION_STRING, strlen(NCNN_VERSION_STRING));
+    }
+
+#if _WIN32
+    const std::wstring path = cain_cache_path(cachedir, name, hash, "spv");
+    const std::wstring tmppath = cain_cache_temp_path(path);
+    FILE* fp = _wfopen(path.c_str(), L"rb");
+#else
+    const std::string path = cain_cache_path(cachedir, name, hash, "spv");
+    const std::string tmppath = cain_cache_temp_path(path);
+    FILE* fp = fopen(path.c_str(), "rb");
+#endif
+
+    // warm start
+    if (fp)
+    {
+        fseek(fp, 0, SEEK_END);
+        long length = ftell(fp);
+        rewind(fp);
+
+        if (length > 0 && length % 4 == 0)
+        {
+            spirv.resize(length / 4);
+            if (fread(spirv.data(), 1, length, fp) != (size_t)length)
+                spirv.clear();
+        }
+
+        fclose(fp);
+
+        if (!spirv.empty())
+            return;
+    }
+
+    compile_spirv_module(comp_data, comp_data_size, opt, spirv);
+    if (spirv.empty())
+        return;
+
+#if _WIN32
+    fp = _wfopen(tmppath.c_str(), L"wb");
+#else
+    fp = fopen(tmppath.c_str(), "wb");
+#endif
+    if (!fp)
+        return;
+
+    size_t nwrite = fwrite(spirv.data(), 4, spirv.size(), fp);
+    fclose(fp);
+
+#if _WIN32
+    if (nwrite != spirv.size() || !MoveFileExW(tmppath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING))
+        _wremove(tmppath.c_str());
+#else
+    if (nwrite != spirv.size() || rename(tmppath.c_str(), path.c_str()) != 0)
+        remove(tmppath.c_str());
+#endif
+}
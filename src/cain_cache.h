@@ -0,0 +1,38 @@
+// cain implemented with ncnn library
+
+#ifndef CAIN_CACHE_H
+#define CAIN_CACHE_H
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+// ncnn
+#include "gpu.h"
+#include "option.h"
+
+// files in the -c cache directory are named after a hash of everything their content depends on
+// a stale file is simply never looked up again
+#define CAIN_CACHE_HASH_INIT 0xcbf29ce484222325ULL
+
+// fnv-1a, chain the calls starting from CAIN_CACHE_HASH_INIT
+unsigned long long cain_cache_hash(unsigned long long hash, const void* data, size_t size);
+
+// cachedir/name-hash.ext
+// the temp path is where the file is written aside and renamed from, so that concurrent jobs never read a partial file
+#if _WIN32
+std::wstring cain_cache_path(const std::wstring& cachedir, const char* name, unsigned long long hash, const char* ext);
+std::wstring cain_cache_temp_path(const std::wstring& path);
+#else
+std::string cain_cache_path(const std::string& cachedir, const char* name, unsigned long long hash, const char* ext);
+std::string cain_cache_temp_path(const std::string& path);
+#endif
+
+// compile_spirv_module that keeps the spirv in cachedir so that warm starts skip glslang, empty cachedir to disable
+#if _WIN32
+void cain_compile_spirv_module_cached(const char* comp_data, int comp_data_size, const char* name, const ncnn::Option& opt, const ncnn::VulkanDevice* vkdev, const std::wstring& cachedir, std::vector<uint32_t>& spirv);
+#else
+void cain_compile_spirv_module_cached(const char* comp_data, int comp_data_size, const char* name, const ncnn::Option& opt, const ncnn::VulkanDevice* vkdev, const std::string& cachedir, std::vector<uint32_t>& spirv);
+#endif
+
+#endif // CAIN_CACHE_H
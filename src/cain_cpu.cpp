@@ -0,0 +1,334 @@
+// cain implemented with ncnn library
+
+#include "cain_cpu.h"
+
+#include <algorithm>
+
+// ncnn
+#include "cpu.h"
+
+#if __ARM_NEON
+#include <arm_neon.h>
+#endif // __ARM_NEON
+
+#if CAIN_CPU_AVX2
+// implemented in cain_cpu_avx2.cpp
+int cain_preproc_reorg8_row_avx2(const unsigned char* srcrow, int w, int bgr, const float bias[3], float* const outptrs[3], int outw);
+int cain_postproc_shuffle8_row_avx2(const float* const inptrs[3], int instep, int w, int bgr, const float bias[3], unsigned char* dstrow);
+int cain_image_sum_avx2(const unsigned char* pixeldata, int size, unsigned long long sum[3]);
+
+static bool cpu_support_avx2()
+{
+    static int support = ncnn::cpu_support_x86_avx2() && ncnn::cpu_support_x86_fma();
+    return support != 0;
+}
+#endif // CAIN_CPU_AVX2
+
+#if __ARM_NEON
+static int image_sum_neon(const unsigned char* pixeldata, int size, unsigned long long sum[3])
+{
+    const int nn = size / 16;
+
+    uint64x2_t _sum0 = vdupq_n_u64(0);
+    uint64x2_t _sum1 = vdupq_n_u64(0);
+    uint64x2_t _sum2 = vdupq_n_u64(0);
+
+    for (int i = 0; i < nn;)
+    {
+        // 16-bit lanes gain at most 510 per step, flush them before they overflow
+        const int nn_u16 = std::min(nn - i, 128);
+
+        uint16x8_t _sum0_u16 = vdupq_n_u16(0);
+        uint16x8_t _sum1_u16 = vdupq_n_u16(0);
+        uint16x8_t _sum2_u16 = vdupq_n_u16(0);
+
+        for (int k = 0; k < nn_u16; k++)
+        {
+            uint8x16x3_t _rgb = vld3q_u8(pixeldata + (i + k) * 48);
+
+            _sum0_u16 = vpadalq_u8(_sum0_u16, _rgb.val[0]);
+            _sum1_u16 = vpadalq_u8(_sum1_u16, _rgb.val[1]);
+            _sum2_u16 = vpadalq_u8(_sum2_u16, _rgb.val[2]);
+        }
+
+        _sum0 = vpadalq_u32(_sum0, vpaddlq_u16(_sum0_u16));
+        _sum1 = vpadalq_u32(_sum1, vpaddlq_u16(_sum1_u16));
+        _sum2 = vpadalq_u32(_sum2, vpaddlq_u16(_sum2_u16));
+
+        i += nn_u16;
+    }
+
+    sum[0] += vgetq_lane_u64(_sum0, 0) + vgetq_lane_u64(_sum0, 1);
+    sum[1] += vgetq_lane_u64(_sum1, 0) + vgetq_lane_u64(_sum1, 1);
+    sum[2] += vgetq_lane_u64(_sum2, 0) + vgetq_lane_u64(_sum2, 1);
+
+    return nn * 16;
+}
+
+// outptrs[q * 2] and outptrs[q * 2 + 1] point to the pack4 groups holding sw 0..3 and sw 4..7 of channel q
+static int preproc_reorg8_row_neon(const unsigned char* srcrow, int w, int bgr, const float bias[3], float* const outptrs[6], int outw)
+{
+    const int nn = std::min(outw, w / 8);
+
+    const float32x4_t _norm = vdupq_n_f32(1 / 255.f);
+    const float32x4_t _bias0 = vdupq_n_f32(bias[0]);
+    const float32x4_t _bias1 = vdupq_n_f32(bias[1]);
+    const float32x4_t _bias2 = vdupq_n_f32(bias[2]);
+
+    for (int j = 0; j < nn; j++)
+    {
+        uint8x8x3_t _rgb = vld3_u8(srcrow + j * 24);
+
+        uint16x8_t _r16 = vmovl_u8(bgr ? _rgb.val[2] : _rgb.val[0]);
+        uint16x8_t _g16 = vmovl_u8(_rgb.val[1]);
+        uint16x8_t _b16 = vmovl_u8(bgr ? _rgb.val[0] : _rgb.val[2]);
+
+        float32x4_t _r0 = vcvtq_f32_u32(vmovl_u16(vget_low_u16(_r16)));
+        float32x4_t _r1 = vcvtq_f32_u32(vmovl_u16(vget_high_u16(_r16)));
+        float32x4_t _g0 = vcvtq_f32_u32(vmovl_u16(vget_low_u16(_g16)));
+        float32x4_t _g1 = vcvtq_f32_u32(vmovl_u16(vget_high_u16(_g16)));
+        float32x4_t _b0 = vcvtq_f32_u32(vmovl_u16(vget_low_u16(_b16)));
+        float32x4_t _b1 = vcvtq_f32_u32(vmovl_u16(vget_high_u16(_b16)));
+
+        vst1q_f32(outptrs[0] + j * 4, vmlaq_f32(_bias0, _r0, _norm));
+        vst1q_f32(outptrs[1] + j * 4, vmlaq_f32(_bias0, _r1, _norm));
+        vst1q_f32(outptrs[2] + j * 4, vmlaq_f32(_bias1, _g0, _norm));
+        vst1q_f32(outptrs[3] + j * 4, vmlaq_f32(_bias1, _g1, _norm));
+        vst1q_f32(outptrs[4] + j * 4, vmlaq_f32(_bias2, _b0, _norm));
+        vst1q_f32(outptrs[5] + j * 4, vmlaq_f32(_bias2, _b1, _norm));
+    }
+
+    return nn;
+}
+
+// inptrs[p * 2] and inptrs[p * 2 + 1] point to the pack4 groups holding sw 0..3 and sw 4..7 of channel p
+static int postproc_shuffle8_row_neon(const float* const inptrs[6], int w, int bgr, const float bias[3], unsigned char* dstrow)
+{
+    const int nn = w / 8;
+
+    const float32x4_t _denorm = vdupq_n_f32(255.f);
+    const float32x4_t _zero = vdupq_n_f32(0.f);
+    const float32x4_t _max = vdupq_n_f32(255.f);
+
+    for (int j = 0; j < nn; j++)
+    {
+        uint8x8x3_t _rgb;
+        for (int p = 0; p < 3; p++)
+        {
+            const float32x4_t _bias = vdupq_n_f32(bias[p]);
+
+            float32x4_t _v0 = vmlaq_f32(_bias, vld1q_f32(inptrs[p * 2] + j * 4), _denorm);
+            float32x4_t _v1 = vmlaq_f32(_bias, vld1q_f32(inptrs[p * 2 + 1] + j * 4), _denorm);
+            _v0 = vminq_f32(vmaxq_f32(_v0, _zero), _max);
+            _v1 = vminq_f32(vmaxq_f32(_v1, _zero), _max);
+
+            uint16x8_t _v16 = vcombine_u16(vmovn_u32(vcvtq_u32_f32(_v0)), vmovn_u32(vcvtq_u32_f32(_v1)));
+
+            _rgb.val[bgr ? 2 - p : p] = vqmovn_u16(_v16);
+        }
+
+        vst3_u8(dstrow + j * 24, _rgb);
+    }
+
+    return nn;
+}
+#endif // __ARM_NEON
+
+void cain_image_mean(const unsigned char* pixeldata, int w, int h, float mean_rgb[3])
+{
+    const int size = w * h;
+
+    unsigned long long sum[3] = {0, 0, 0};
+
+    int i = 0;
+#if CAIN_CPU_AVX2
+    if (cpu_support_avx2())
+    {
+        i = cain_image_sum_avx2(pixeldata, size, sum);
+    }
+#endif // CAIN_CPU_AVX2
+#if __ARM_NEON
+    i = image_sum_neon(pixeldata, size, sum);
+#endif // __ARM_NEON
+
+    for (; i < size; i++)
+    {
+        sum[0] += pixeldata[i * 3];
+        sum[1] += pixeldata[i * 3 + 1];
+        sum[2] += pixeldata[i * 3 + 2];
+    }
+
+    mean_rgb[0] = (float)((double)sum[0] / size / 255.0);
+    mean_rgb[1] = (float)((double)sum[1] / size / 255.0);
+    mean_rgb[2] = (float)((double)sum[2] / size / 255.0);
+}
+
+// scalar path for any stride and elempack, also finishes the right border columns of the simd paths
+static void preproc_reorg_row(const unsigned char* srcrow, int w, int bgr, const float bias[3], int stride, int sh, int i, int j_start, ncnn::Mat& out)
+{
+    const int outw = out.w;
+    const int elempack = out.elempack;
+    const float norm_val = 1 / 255.f;
+
+    for (int q = 0; q < 3; q++)
+    {
+        const int sq = bgr ? 2 - q : q;
+
+        for (int sw = 0; sw < stride; sw++)
+        {
+            const int c = (q * stride + sh) * stride + sw;
+
+            float* outptr = (float*)out.channel(c / elempack) + i * outw * elempack + c % elempack;
+
+            for (int j = j_start; j < outw; j++)
+            {
+                // border replicate
+                const int sx = std::min(j * stride + sw, w - 1);
+
+                outptr[j * elempack] = srcrow[sx * 3 + sq] * norm_val + bias[q];
+            }
+        }
+    }
+}
+
+void cain_preproc_reorg(const unsigned char* pixeldata, int w, int h, int bgr, const float mean_rgb[3], int w_padded, int h_padded, int stride, ncnn::Mat& out, const ncnn::Option& opt)
+{
+    const int outw = w_padded / stride;
+    const int outh = h_padded / stride;
+    const int outc = 3 * stride * stride;
+
+    int elempack = 1;
+    if (opt.use_packing_layout)
+    {
+#if CAIN_CPU_AVX2
+        elempack = stride == 8 && cpu_support_avx2() ? 8 : 4;
+#else
+        elempack = 4;
+#endif
+        if (outc % elempack != 0)
+            elempack = 1;
+    }
+
+    out.create(outw, outh, outc / elempack, (size_t)4u * elempack, elempack, opt.blob_allocator);
+    if (out.empty())
+        return;
+
+    const float bias[3] = {-mean_rgb[0], -mean_rgb[1], -mean_rgb[2]};
+
+    #pragma omp parallel for num_threads(opt.num_threads)
+    for (int y = 0; y < h_padded; y++)
+    {
+        const int i = y / stride;
+        const int sh = y % stride;
+
+        // border replicate
+        const unsigned char* srcrow = pixeldata + std::min(y, h - 1) * w * 3;
+
+        int j = 0;
+#if CAIN_CPU_AVX2
+        if (stride == 8 && elempack == 8)
+        {
+            // the 8 sw columns of one output pixel form exactly one pack8 group
+            float* outptrs[3];
+            for (int q = 0; q < 3; q++)
+            {
+                outptrs[q] = (float*)out.channel(q * 8 + sh) + i * outw * 8;
+            }
+
+            j = cain_preproc_reorg8_row_avx2(srcrow, w, bgr, bias, outptrs, outw);
+        }
+#endif // CAIN_CPU_AVX2
+#if __ARM_NEON
+        if (stride == 8 && elempack == 4)
+        {
+            float* outptrs[6];
+            for (int q = 0; q < 3; q++)
+            {
+                outptrs[q * 2] = (float*)out.channel(q * 16 + sh * 2) + i * outw * 4;
+                outptrs[q * 2 + 1] = (float*)out.channel(q * 16 + sh * 2 + 1) + i * outw * 4;
+            }
+
+            j = preproc_reorg8_row_neon(srcrow, w, bgr, bias, outptrs, outw);
+        }
+#endif // __ARM_NEON
+
+        preproc_reorg_row(srcrow, w, bgr, bias, stride, sh, i, j, out);
+    }
+}
+
+// scalar path for any stride and elempack, also finishes the right border columns of the simd paths
+static void postproc_shuffle_row(const ncnn::Mat& in, int stride, const float bias[3], int bgr, unsigned char* dstrow, int w, int y, int x_start)
+{
+    const int inw = in.w;
+    const int elempack = in.elempack;
+    const int i = y / stride;
+    const int sh = y % stride;
+
+    for (int p = 0; p < 3; p++)
+    {
+        const int dp = bgr ? 2 - p : p;
+
+        for (int x = x_start; x < w; x++)
+        {
+            const int j = x / stride;
+            const int sw = x % stride;
+            const int c = (p * stride + sh) * stride + sw;
+
+            const float* ptr = (const float*)in.channel(c / elempack) + (i * inw + j) * elempack + c % elempack;
+
+            float v = ptr[0] * 255.f + bias[p];
+            v = std::min(std::max(v, 0.f), 255.f);
+
+            dstrow[x * 3 + dp] = (unsigned char)(int)v;
+        }
+    }
+}
+
+void cain_postproc_shuffle(const ncnn::Mat& in, int stride, const float mean_rgb[3], int bgr, unsigned char* pixeldata, int w, int h, const ncnn::Option& opt)
+{
+    const int inw = in.w;
+    const int elempack = in.elempack;
+
+    // (v + mean) * 255 + 0.5 with the rounding of cain_postproc.comp
+    const float bias[3] = {mean_rgb[0] * 255.f + 0.5f, mean_rgb[1] * 255.f + 0.5f, mean_rgb[2] * 255.f + 0.5f};
+
+    #pragma omp parallel for num_threads(opt.num_threads)
+    for (int y = 0; y < h; y++)
+    {
+        const int i = y / stride;
+        const int sh = y % stride;
+
+        unsigned char* dstrow = pixeldata + y * w * 3;
+
+        int x = 0;
+#if CAIN_CPU_AVX2
+        if (stride == 8 && (elempack == 8 || elempack == 16) && cpu_support_avx2())
+        {
+            // the 8 sw lanes of one input pixel are 8 adjacent output pixels
+            const float* inptrs[3];
+            for (int p = 0; p < 3; p++)
+            {
+                const int c = (p * 8 + sh) * 8;
+                inptrs[p] = (const float*)in.channel(c / elempack) + i * inw * elempack + c % elempack;
+            }
+
+            x = cain_postproc_shuffle8_row_avx2(inptrs, elempack, w, bgr, bias, dstrow) * 8;
+        }
+#endif // CAIN_CPU_AVX2
+#if __ARM_NEON
+        if (stride == 8 && elempack == 4)
+        {
+            const float* inptrs[6];
+            for (int p = 0; p < 3; p++)
+            {
+                inptrs[p * 2] = (const float*)in.channel(p * 16 + sh * 2) + i * inw * 4;
+                inptrs[p * 2 + 1] = (const float*)in.channel(p * 16 + sh * 2 + 1) + i * inw * 4;
+            }
+
+            x = postproc_shuffle8_row_neon(inptrs, w, bgr, bias, dstrow) * 8;
+        }
+#endif // __ARM_NEON
+
+        postproc_shuffle_row(in, stride, bias, bgr, dstrow, w, y, x);
+    }
+}
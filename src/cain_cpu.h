@@ -0,0 +1,25 @@
+// cain implemented with ncnn library
+
+#ifndef CAIN_CPU_H
+#define CAIN_CPU_H
+
+// ncnn
+#include "mat.h"
+#include "option.h"
+
+// per-channel mean of interleaved 8-bit pixels in pixel order, normalized to 0..1
+// accumulates in integers with simd so the loader can afford it once per decoded frame
+void cain_image_mean(const unsigned char* pixeldata, int w, int h, float mean_rgb[3]);
+
+// fused cpu preprocess, the host counterpart of cain_preproc.comp followed by the stride-n Reorg layer
+// reads interleaved rgb/bgr pixels once and writes the normalized, mean subtracted, border replicated
+// and space-to-depth tensor of size (w_padded / stride) x (h_padded / stride) x (3 * stride * stride)
+// mean_rgb is in output channel order r g b, the tensor is packed to the elempack the ncnn cpu layers prefer
+void cain_preproc_reorg(const unsigned char* pixeldata, int w, int h, int bgr, const float mean_rgb[3], int w_padded, int h_padded, int stride, ncnn::Mat& out, const ncnn::Option& opt);
+
+// fused cpu postprocess, the host counterpart of the stride-n PixelShuffle layer followed by cain_postproc.comp
+// reads the (3 * stride * stride)-channel fp32 blob in any elempack and writes the mean restored, denormalized,
+// clamped and cropped w x h interleaved rgb/bgr pixels without materializing the full resolution float image
+void cain_postproc_shuffle(const ncnn::Mat& in, int stride, const float mean_rgb[3], int bgr, unsigned char* pixeldata, int w, int h, const ncnn::Option& opt);
+
+#endif // CAIN_CPU_H
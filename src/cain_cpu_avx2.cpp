@@ -0,0 +1,148 @@
+// cain implemented with ncnn library
+
+// this file is compiled with avx2 and fma enabled, call it only after cpu_support_x86_avx2()
+// keep ncnn headers out of here so that no inline function gets emitted with avx2 instructions
+
+#include <immintrin.h>
+
+int cain_image_sum_avx2(const unsigned char* pixeldata, int size, unsigned long long sum[3])
+{
+    const int nn = size / 32;
+
+    // 32 pixels span 3 vectors, byte l of vector v belongs to channel (v * 32 + l) % 3
+    __m256i _masks[3][3];
+    for (int v = 0; v < 3; v++)
+    {
+        unsigned char m[3][32];
+        for (int l = 0; l < 32; l++)
+        {
+            const int c = (v * 32 + l) % 3;
+            m[0][l] = c == 0 ? 0xff : 0;
+            m[1][l] = c == 1 ? 0xff : 0;
+            m[2][l] = c == 2 ? 0xff : 0;
+        }
+
+        _masks[v][0] = _mm256_loadu_si256((const __m256i*)m[0]);
+        _masks[v][1] = _mm256_loadu_si256((const __m256i*)m[1]);
+        _masks[v][2] = _mm256_loadu_si256((const __m256i*)m[2]);
+    }
+
+    const __m256i _zero = _mm256_setzero_si256();
+
+    // sad against zero sums 8 bytes into a 64-bit lane, no overflow handling needed
+    __m256i _sum0 = _mm256_setzero_si256();
+    __m256i _sum1 = _mm256_setzero_si256();
+    __m256i _sum2 = _mm256_setzero_si256();
+
+    for (int i = 0; i < nn; i++)
+    {
+        const unsigned char* p = pixeldata + i * 96;
+
+        for (int v = 0; v < 3; v++)
+        {
+            __m256i _p = _mm256_loadu_si256((const __m256i*)(p + v * 32));
+
+            _sum0 = _mm256_add_epi64(_sum0, _mm256_sad_epu8(_mm256_and_si256(_p, _masks[v][0]), _zero));
+            _sum1 = _mm256_add_epi64(_sum1, _mm256_sad_epu8(_mm256_and_si256(_p, _masks[v][1]), _zero));
+            _sum2 = _mm256_add_epi64(_sum2, _mm256_sad_epu8(_mm256_and_si256(_p, _masks[v][2]), _zero));
+        }
+    }
+
+    unsigned long long tmp[3][4];
+    _mm256_storeu_si256((__m256i*)tmp[0], _sum0);
+    _mm256_storeu_si256((__m256i*)tmp[1], _sum1);
+    _mm256_storeu_si256((__m256i*)tmp[2], _sum2);
+
+    for (int c = 0; c < 3; c++)
+    {
+        sum[c] += tmp[c][0] + tmp[c][1] + tmp[c][2] + tmp[c][3];
+    }
+
+    return nn * 32;
+}
+
+// outptrs[q] points to the pack8 group holding sw 0..7 of channel q
+int cain_preproc_reorg8_row_avx2(const unsigned char* srcrow, int w, int bgr, const float bias[3], float* const outptrs[3], int outw)
+{
+    const int nn = outw < w / 8 ? outw : w / 8;
+
+    // deinterleave 8 packed rgb pixels, 16 bytes in lo and 8 bytes in hi
+    const __m128i _mask0_lo = _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i _mask0_hi = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i _mask1_lo = _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i _mask1_hi = _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i _mask2_lo = _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i _mask2_hi = _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, -1, -1, -1, -1, -1, -1, -1, -1);
+
+    const __m256 _norm = _mm256_set1_ps(1 / 255.f);
+    const __m256 _bias0 = _mm256_set1_ps(bias[0]);
+    const __m256 _bias1 = _mm256_set1_ps(bias[1]);
+    const __m256 _bias2 = _mm256_set1_ps(bias[2]);
+
+    for (int j = 0; j < nn; j++)
+    {
+        const unsigned char* p = srcrow + j * 24;
+
+        __m128i _lo = _mm_loadu_si128((const __m128i*)p);
+        __m128i _hi = _mm_loadl_epi64((const __m128i*)(p + 16));
+
+        __m128i _c0 = _mm_or_si128(_mm_shuffle_epi8(_lo, _mask0_lo), _mm_shuffle_epi8(_hi, _mask0_hi));
+        __m128i _c1 = _mm_or_si128(_mm_shuffle_epi8(_lo, _mask1_lo), _mm_shuffle_epi8(_hi, _mask1_hi));
+        __m128i _c2 = _mm_or_si128(_mm_shuffle_epi8(_lo, _mask2_lo), _mm_shuffle_epi8(_hi, _mask2_hi));
+
+        __m256 _r = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(bgr ? _c2 : _c0));
+        __m256 _g = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_c1));
+        __m256 _b = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(bgr ? _c0 : _c2));
+
+        _mm256_storeu_ps(outptrs[0] + j * 8, _mm256_fmadd_ps(_r, _norm, _bias0));
+        _mm256_storeu_ps(outptrs[1] + j * 8, _mm256_fmadd_ps(_g, _norm, _bias1));
+        _mm256_storeu_ps(outptrs[2] + j * 8, _mm256_fmadd_ps(_b, _norm, _bias2));
+    }
+
+    return nn;
+}
+
+// inptrs[p] points to the 8 adjacent sw lanes of channel p, one input pixel is instep floats away
+int cain_postproc_shuffle8_row_avx2(const float* const inptrs[3], int instep, int w, int bgr, const float bias[3], unsigned char* dstrow)
+{
+    const int nn = w / 8;
+
+    // interleave r0..r7 g0..g7 in rg and b0..b7 in b into 24 bytes
+    const __m128i _mask0_rg = _mm_setr_epi8(0, 8, -1, 1, 9, -1, 2, 10, -1, 3, 11, -1, 4, 12, -1, 5);
+    const __m128i _mask0_b = _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1);
+    const __m128i _mask1_rg = _mm_setr_epi8(13, -1, 6, 14, -1, 7, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i _mask1_b = _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, -1, -1, -1, -1, -1, -1);
+
+    const __m256 _denorm = _mm256_set1_ps(255.f);
+    const __m256 _zero = _mm256_setzero_ps();
+    const __m256 _max = _mm256_set1_ps(255.f);
+    const __m256 _bias0 = _mm256_set1_ps(bias[0]);
+    const __m256 _bias1 = _mm256_set1_ps(bias[1]);
+    const __m256 _bias2 = _mm256_set1_ps(bias[2]);
+
+    for (int j = 0; j < nn; j++)
+    {
+        __m256 _r = _mm256_fmadd_ps(_mm256_loadu_ps(inptrs[0] + j * instep), _denorm, _bias0);
+        __m256 _g = _mm256_fmadd_ps(_mm256_loadu_ps(inptrs[1] + j * instep), _denorm, _bias1);
+        __m256 _b = _mm256_fmadd_ps(_mm256_loadu_ps(inptrs[2] + j * instep), _denorm, _bias2);
+
+        __m256i _r32 = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(_r, _zero), _max));
+        __m256i _g32 = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(_g, _zero), _max));
+        __m256i _b32 = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(_b, _zero), _max));
+
+        __m128i _r16 = _mm_packs_epi32(_mm256_castsi256_si128(_r32), _mm256_extracti128_si256(_r32, 1));
+        __m128i _g16 = _mm_packs_epi32(_mm256_castsi256_si128(_g32), _mm256_extracti128_si256(_g32, 1));
+        __m128i _b16 = _mm_packs_epi32(_mm256_castsi256_si128(_b32), _mm256_extracti128_si256(_b32, 1));
+
+        __m128i _rg = bgr ? _mm_packus_epi16(_b16, _g16) : _mm_packus_epi16(_r16, _g16);
+        __m128i _bb = bgr ? _mm_packus_epi16(_r16, _r16) : _mm_packus_epi16(_b16, _b16);
+
+        __m128i _out0 = _mm_or_si128(_mm_shuffle_epi8(_rg, _mask0_rg), _mm_shuffle_epi8(_bb, _mask0_b));
+        __m128i _out1 = _mm_or_si128(_mm_shuffle_epi8(_rg, _mask1_rg), _mm_shuffle_epi8(_bb, _mask1_b));
+
+        _mm_storeu_si128((__m128i*)(dstrow + j * 24), _out0);
+        _mm_storel_epi64((__m128i*)(dstrow + j * 24 + 16), _out1);
+    }
+
+    return nn;
+}
@@ -0,0 +1,1461 @@
+// cain implemented with ncnn library
+
+#include "cain_layers.h"
+#include "cain_cache.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// ncnn
+#include "datareader.h"
+#include "layer_type.h"
+#include "gpu.h"
+#include "command.h"
+#include "pipeline.h"
+
+#include "cain_reflect_pad.comp.hex.h"
+#include "cain_reflect_pad_pack4.comp.hex.h"
+#include "cain_scale_add.comp.hex.h"
+#include "cain_scale_add_pack4.comp.hex.h"
+#include "cain_reflect_pad_rowsum.comp.hex.h"
+#include "cain_reflect_pad_rowsum_pack4.comp.hex.h"
+#include "cain_window_mean.comp.hex.h"
+#include "cain_window_mean_pack4.comp.hex.h"
+#include "cain_residual_add.comp.hex.h"
+#include "cain_residual_add_pack4.comp.hex.h"
+
+// set while a tile pass feeds the pooled blobs from frame-level statistics
+static thread_local int gap_stats_fed = 0;
+
+void cain_set_gap_stats_fed(int fed)
+{
+    gap_stats_fed = fed;
+}
+
+static int reflect_index(int i, int size)
+{
+    i = i < 0 ? -i : i;
+    return i >= size ? 2 * (size - 1) - i : i;
+}
+
+// element access for the cpu kernels, they compute in fp32 whatever the blobs are stored in
+struct fp32_storage
+{
+    typedef float type;
+    static float load(float v)
+    {
+        return v;
+    }
+    static float store(float v)
+    {
+        return v;
+    }
+};
+
+struct fp16_storage
+{
+    typedef unsigned short type;
+    static float load(unsigned short v)
+    {
+        return ncnn::float16_to_float32(v);
+    }
+    static unsigned short store(float v)
+    {
+        return ncnn::float32_to_float16(v);
+    }
+};
+
+struct bf16_storage
+{
+    typedef unsigned short type;
+    static float load(unsigned short v)
+    {
+        return ncnn::bfloat16_to_float32(v);
+    }
+    static unsigned short store(float v)
+    {
+        return ncnn::float32_to_bfloat16(v);
+    }
+};
+
+enum
+{
+    STORAGE_FP32 = 0,
+    STORAGE_FP16 = 1,
+    STORAGE_BF16 = 2
+};
+
+// a 16-bit blob is fp16 when fp16 storage is on and bf16 otherwise, the same rule ncnn layers follow
+static int storage_type(const ncnn::Mat& m, const ncnn::Option& opt)
+{
+    if (m.elembits() != 16)
+        return STORAGE_FP32;
+
+    return opt.use_fp16_storage ? STORAGE_FP16 : STORAGE_BF16;
+}
+
+// compile once per process, the spirv is shared by all layers and devices
+#if _WIN32
+static ncnn::Pipeline* create_cain_pipeline(const ncnn::VulkanDevice* vkdev, const char* comp_data, int comp_data_size, const char* name, const std::wstring& cachedir, std::vector<uint32_t>& spirv, ncnn::Mutex& lock, int local_size_x, int local_size_y, int local_size_z, const ncnn::Option& opt)
+#else
+static ncnn::Pipeline* create_cain_pipeline(const ncnn::VulkanDevice* vkdev, const char* comp_data, int comp_data_size, const char* name, const std::string& cachedir, std::vector<uint32_t>& spirv, ncnn::Mutex& lock, int local_size_x, int local_size_y, int local_size_z, const ncnn::Option& opt)
+#endif
+{
+    {
+        ncnn::MutexLockGuard guard(lock);
+        if (spirv.empty())
+        {
+            cain_compile_spirv_module_cached(comp_data, comp_data_size, name, opt, vkdev, cachedir, spirv);
+        }
+    }
+
+    std::vector<ncnn::vk_specialization_type> specializations(0);
+
+    ncnn::Pipeline* pipeline = new ncnn::Pipeline(vkdev);
+    pipeline->set_optimal_local_size_xyz(local_size_x, local_size_y, local_size_z);
+    pipeline->create(spirv.data(), spirv.size() * 4, specializations);
+
+    return pipeline;
+}
+
+#define CAIN_CREATE_PIPELINE(name, x, y, z)                                                                              \
+    {                                                                                                                    \
+        static std::vector<uint32_t> spirv;                                                                              \
+        static ncnn::Mutex lock;                                                                                         \
+        pipeline_##name = create_cain_pipeline(vkdev, cain_##name##_comp_data, sizeof(cain_##name##_comp_data), "cain_" #name, cachedir, spirv, lock, x, y, z, opt); \
+    }
+
+ReflectConvolution::ReflectConvolution()
+{
+    one_blob_only = true;
+    support_inplace = false;
+
+    pad = 1;
+    gap_epilogue = 0;
+    convolution = 0;
+
+    pipeline_reflect_pad = 0;
+    pipeline_reflect_pad_pack4 = 0;
+    pipeline_reflect_pad_rowsum = 0;
+    pipeline_reflect_pad_rowsum_pack4 = 0;
+    pipeline_window_mean = 0;
+    pipeline_window_mean_pack4 = 0;
+    pipeline_residual_add = 0;
+    pipeline_residual_add_pack4 = 0;
+}
+
+ReflectConvolution::~ReflectConvolution()
+{
+    delete convolution;
+}
+
+int ReflectConvolution::create_pipeline(const ncnn::Option& opt)
+{
+    // the convolution pipeline was created by the net already
+    if (!vkdev)
+        return 0;
+
+    // called again once a later pass turns on an epilogue, only create what is missing
+    if (!pipeline_reflect_pad)
+    {
+        CAIN_CREATE_PIPELINE(reflect_pad, 8, 8, 1)
+        CAIN_CREATE_PIPELINE(reflect_pad_pack4, 8, 8, 1)
+    }
+
+    if (gap_epilogue && !pipeline_reflect_pad_rowsum)
+    {
+        // the row reduction in the shader assumes exactly 64 invocations along x
+        // vulkan guarantees at least 128 invocations per workgroup so this is never shrunk
+        CAIN_CREATE_PIPELINE(reflect_pad_rowsum, 64, 1, 1)
+        CAIN_CREATE_PIPELINE(reflect_pad_rowsum_pack4, 64, 1, 1)
+
+        CAIN_CREATE_PIPELINE(window_mean, 4, 4, 16)
+        CAIN_CREATE_PIPELINE(window_mean_pack4, 4, 4, 16)
+    }
+
+    if (bottoms.size() > 1 && !pipeline_residual_add)
+    {
+        CAIN_CREATE_PIPELINE(residual_add, 8, 8, 1)
+        CAIN_CREATE_PIPELINE(residual_add_pack4, 8, 8, 1)
+    }
+
+    return 0;
+}
+
+int ReflectConvolution::destroy_pipeline(const ncnn::Option& opt)
+{
+    if (convolution)
+    {
+        convolution->destroy_pipeline(opt);
+    }
+
+    delete pipeline_reflect_pad;
+    pipeline_reflect_pad = 0;
+
+    delete pipeline_reflect_pad_pack4;
+    pipeline_reflect_pad_pack4 = 0;
+
+    delete pipeline_reflect_pad_rowsum;
+    pipeline_reflect_pad_rowsum = 0;
+
+    delete pipeline_reflect_pad_rowsum_pack4;
+    pipeline_reflect_pad_rowsum_pack4 = 0;
+
+    delete pipeline_window_mean;
+    pipeline_window_mean = 0;
+
+    delete pipeline_window_mean_pack4;
+    pipeline_window_mean_pack4 = 0;
+
+    delete pipeline_residual_add;
+    pipeline_residual_add = 0;
+
+    delete pipeline_residual_add_pack4;
+    pipeline_residual_add_pack4 = 0;
+
+    return 0;
+}
+
+// window kx of the padded row sums columns kx .. kx + w - 1, one value per lane
+template<typename S>
+static void window_rowsums(const unsigned char* row, int outw, int w, int kernel, int elempack, float* sumptr)
+{
+    const typename S::type* rowptr = (const typename S::type*)row;
+
+    for (int k = 0; k < elempack; k++)
+    {
+        float total = 0.f;
+        for (int x = 0; x < outw; x++)
+        {
+            total += S::load(rowptr[x * elempack + k]);
+        }
+
+        // drop the kx leading and kernel - 1 - kx trailing columns
+        for (int kx = 0; kx < kernel; kx++)
+        {
+            float sum = total;
+            for (int x = 0; x < kx; x++)
+            {
+                sum -= S::load(rowptr[x * elempack + k]);
+            }
+            for (int x = kx + w; x < outw; x++)
+            {
+                sum -= S::load(rowptr[x * elempack + k]);
+            }
+
+            sumptr[kx * elempack + k] = sum;
+        }
+    }
+}
+
+int ReflectConvolution::reflect_pad(const ncnn::Mat& bottom_blob, ncnn::Mat& bottom_blob_padded, ncnn::Mat* window_means, const ncnn::Option& opt) const
+{
+    const int w = bottom_blob.w;
+    const int h = bottom_blob.h;
+    const int channels = bottom_blob.c;
+    const size_t elemsize = bottom_blob.elemsize;
+    const int elempack = bottom_blob.elempack;
+
+    // reflection does not repeat the edge, the map must be wider than the pad
+    if (w <= pad || h <= pad)
+        return -1;
+
+    const int outw = w + pad * 2;
+    const int outh = h + pad * 2;
+    const int kernel = pad * 2 + 1;
+
+    // the padded copy is a workspace, not a graph blob
+    bottom_blob_padded.create(outw, outh, channels, elemsize, elempack, opt.workspace_allocator);
+    if (bottom_blob_padded.empty())
+        return -100;
+
+    // window sums of every padded row
+    const int storage = storage_type(bottom_blob, opt);
+    void (*rowsums_func)(const unsigned char*, int, int, int, int, float*) = storage == STORAGE_FP16 ? window_rowsums<fp16_storage> : storage == STORAGE_BF16 ? window_rowsums<bf16_storage> : window_rowsums<fp32_storage>;
+
+    ncnn::Mat rowsums;
+    if (window_means)
+    {
+        rowsums.create(kernel * elempack, outh, channels, 4u, opt.workspace_allocator);
+        if (rowsums.empty())
+            return -100;
+    }
+
+    // element type agnostic, one element is elemsize bytes whatever the packing and storage
+    #pragma omp parallel for num_threads(opt.num_threads)
+    for (int q = 0; q < channels; q++)
+    {
+        const unsigned char* ptr = bottom_blob.channel(q);
+        unsigned char* outptr = bottom_blob_padded.channel(q);
+
+        for (int y = 0; y < outh; y++)
+        {
+            const unsigned char* srcrow = ptr + reflect_index(y - pad, h) * w * elemsize;
+            unsigned char* dstrow = outptr + y * outw * elemsize;
+
+            for (int x = 0; x < pad; x++)
+            {
+                memcpy(dstrow + x * elemsize, srcrow + (pad - x) * elemsize, elemsize);
+            }
+
+            memcpy(dstrow + pad * elemsize, srcrow, w * elemsize);
+
+            for (int x = 0; x < pad; x++)
+            {
+                memcpy(dstrow + (pad + w + x) * elemsize, srcrow + (w - 2 - x) * elemsize, elemsize);
+            }
+
+            if (!window_means)
+                continue;
+
+            // the row was just written and is still in cache
+            rowsums_func(dstrow, outw, w, kernel, elempack, rowsums.channel(q).row(y));
+        }
+    }
+
+    if (!window_means)
+        return 0;
+
+    // mean of the input window each kernel tap sees over all output positions
+    ncnn::Mat means;
+    means.create(kernel, kernel, channels, 4u * elempack, elempack, opt.workspace_allocator);
+    if (means.empty())
+        return -100;
+
+    const float scale = 1.f / (w * h);
+
+    #pragma omp parallel for num_threads(opt.num_threads)
+    for (int q = 0; q < channels; q++)
+    {
+        const ncnn::Mat sums = rowsums.channel(q);
+        float* outptr = means.channel(q);
+
+        for (int ky = 0; ky < kernel; ky++)
+        {
+            for (int kx = 0; kx < kernel; kx++)
+            {
+                for (int k = 0; k < elempack; k++)
+                {
+                    float sum = 0.f;
+                    for (int y = ky; y < ky + h; y++)
+                    {
+                        sum += sums.row(y)[kx * elempack + k];
+                    }
+
+                    outptr[(ky * kernel + kx) * elempack + k] = sum * scale;
+                }
+            }
+        }
+    }
+
+    // the convolution reads the means in the storage of its regular input
+    if (storage == STORAGE_FP32)
+    {
+        *window_means = means;
+        return 0;
+    }
+
+    ncnn::Option opt_cast = opt;
+    opt_cast.blob_allocator = opt.workspace_allocator;
+
+    if (storage == STORAGE_FP16)
+        ncnn::cast_float32_to_float16(means, *window_means, opt_cast);
+    else
+        ncnn::cast_float32_to_bfloat16(means, *window_means, opt_cast);
+
+    if (window_means->empty())
+        return -100;
+
+    return 0;
+}
+
+int ReflectConvolution::forward(const ncnn::Mat& bottom_blob, ncnn::Mat& top_blob, const ncnn::Option& opt) const
+{
+    ncnn::Mat bottom_blob_padded;
+    int ret = reflect_pad(bottom_blob, bottom_blob_padded, 0, opt);
+    if (ret != 0)
+        return ret;
+
+    return convolution->forward(bottom_blob_padded, top_blob, opt);
+}
+
+template<typename S>
+static void residual_add_kernel(const std::vector<ncnn::Mat>& bottom_blobs, ncnn::Mat& top_blob, const ncnn::Option& opt)
+{
+    typedef typename S::type T;
+
+    const int channels = top_blob.c;
+    const int size = top_blob.w * top_blob.h * top_blob.elempack;
+    const int residual_count = (int)bottom_blobs.size() - 1;
+
+    // the convolution output is ours alone, one pass over it for all residuals
+    #pragma omp parallel for num_threads(opt.num_threads)
+    for (int q = 0; q < channels; q++)
+    {
+        T* outptr = top_blob.channel(q);
+
+        const T* rptrs[4];
+        for (int r = 0; r < residual_count; r++)
+        {
+            rptrs[r] = bottom_blobs[1 + r].channel(q);
+        }
+
+        for (int i = 0; i < size; i++)
+        {
+            float sum = S::load(outptr[i]);
+            for (int r = 0; r < residual_count; r++)
+            {
+                sum += S::load(rptrs[r][i]);
+            }
+
+            outptr[i] = S::store(sum);
+        }
+    }
+}
+
+int ReflectConvolution::residual_add(const std::vector<ncnn::Mat>& bottom_blobs, ncnn::Mat& top_blob, const ncnn::Option& opt) const
+{
+    const int storage = storage_type(top_blob, opt);
+
+    if (storage == STORAGE_FP16)
+        residual_add_kernel<fp16_storage>(bottom_blobs, top_blob, opt);
+    else if (storage == STORAGE_BF16)
+        residual_add_kernel<bf16_storage>(bottom_blobs, top_blob, opt);
+    else
+        residual_add_kernel<fp32_storage>(bottom_blobs, top_blob, opt);
+
+    return 0;
+}
+
+int ReflectConvolution::forward(const std::vector<ncnn::Mat>& bottom_blobs, std::vector<ncnn::Mat>& top_blobs, const ncnn::Option& opt) const
+{
+    // the means of a tile are never read when the pooled blob is fed from gap_stats
+    const int epilogue = gap_epilogue && !gap_stats_fed;
+
+    ncnn::Mat bottom_blob_padded;
+    ncnn::Mat window_means;
+    int ret = reflect_pad(bottom_blobs[0], bottom_blob_padded, epilogue ? &window_means : 0, opt);
+    if (ret != 0)
+        return ret;
+
+    ret = convolution->forward(bottom_blob_padded, top_blobs[0], opt);
+    if (ret != 0)
+        return ret;
+
+    if (bottom_blobs.size() > 1)
+    {
+        ret = residual_add(bottom_blobs, top_blobs[0], opt);
+        if (ret != 0)
+            return ret;
+    }
+
+    if (!epilogue)
+        return 0;
+
+    // the convolution is linear, convolving the window means gives the output means
+    return convolution->forward(window_means, top_blobs[1], opt);
+}
+
+int ReflectConvolution::reflect_pad(const ncnn::VkMat& bottom_blob, ncnn::VkMat& bottom_blob_padded, ncnn::VkMat* window_means, ncnn::VkCompute& cmd, const ncnn::Option& opt) const
+{
+    const int w = bottom_blob.w;
+    const int h = bottom_blob.h;
+    const int channels = bottom_blob.c;
+    const size_t elemsize = bottom_blob.elemsize;
+    const int elempack = bottom_blob.elempack;
+
+    // reflection does not repeat the edge, the map must be wider than the pad
+    if (w <= pad || h <= pad)
+        return -1;
+
+    const int outw = w + pad * 2;
+    const int outh = h + pad * 2;
+
+    bottom_blob_padded.create(outw, outh, channels, elemsize, elempack, opt.workspace_vkallocator);
+    if (bottom_blob_padded.empty())
+        return -100;
+
+    if (!window_means)
+    {
+        std::vector<ncnn::VkMat> bindings(2);
+        bindings[0] = bottom_blob;
+        bindings[1] = bottom_blob_padded;
+
+        std::vector<ncnn::vk_constant_type> constants(8);
+        constants[0].i = bottom_blob.w;
+        constants[1].i = bottom_blob.h;
+        constants[2].i = bottom_blob.cstep;
+        constants[3].i = bottom_blob_padded.w;
+        constants[4].i = bottom_blob_padded.h;
+        constants[5].i = bottom_blob_padded.c;
+        constants[6].i = bottom_blob_padded.cstep;
+        constants[7].i = pad;
+
+        const ncnn::Pipeline* pipeline = elempack == 4 ? pipeline_reflect_pad_pack4 : pipeline_reflect_pad;
+
+        cmd.record_pipeline(pipeline, bindings, constants, bottom_blob_padded);
+
+        return 0;
+    }
+
+    // the window sums are accumulated in fp32 whatever the storage
+    ncnn::VkMat rowsums;
+    rowsums.create(3, outh, channels, elempack * 4u, elempack, opt.workspace_vkallocator);
+    if (rowsums.empty())
+        return -100;
+
+    {
+        std::vector<ncnn::VkMat> bindings(3);
+        bindings[0] = bottom_blob;
+        bindings[1] = bottom_blob_padded;
+        bindings[2] = rowsums;
+
+        std::vector<ncnn::vk_constant_type> constants(8);
+        constants[0].i = bottom_blob.w;
+        constants[1].i = bottom_blob.h;
+        constants[2].i = bottom_blob.cstep;
+        constants[3].i = bottom_blob_padded.w;
+        constants[4].i = bottom_blob_padded.h;
+        constants[5].i = bottom_blob_padded.c;
+        constants[6].i = bottom_blob_padded.cstep;
+        constants[7].i = rowsums.cstep;
+
+        // one workgroup per padded row
+        ncnn::VkMat dispatcher;
+        dispatcher.w = 64;
+        dispatcher.h = outh;
+        dispatcher.c = channels;
+
+        const ncnn::Pipeline* pipeline = elempack == 4 ? pipeline_reflect_pad_rowsum_pack4 : pipeline_reflect_pad_rowsum;
+
+        cmd.record_pipeline(pipeline, bindings, constants, dispatcher);
+    }
+
+    window_means->create(3, 3, channels, elemsize, elempack, opt.workspace_vkallocator);
+    if (window_means->empty())
+        return -100;
+
+    {
+        std::vector<ncnn::VkMat> bindings(2);
+        bindings[0] = rowsums;
+        bindings[1] = *window_means;
+
+        std::vector<ncnn::vk_constant_type> constants(5);
+        constants[0].i = h;
+        constants[1].i = rowsums.cstep;
+        constants[2].i = window_means->c;
+        constants[3].i = window_means->cstep;
+        constants[4].f = 1.f / (w * h);
+
+        const ncnn::Pipeline* pipeline = elempack == 4 ? pipeline_window_mean_pack4 : pipeline_window_mean;
+
+        cmd.record_pipeline(pipeline, bindings, constants, *window_means);
+    }
+
+    return 0;
+}
+
+int ReflectConvolution::forward(const ncnn::VkMat& bottom_blob, ncnn::VkMat& top_blob, ncnn::VkCompute& cmd, const ncnn::Option& opt) const
+{
+    ncnn::VkMat bottom_blob_padded;
+    int ret = reflect_pad(bottom_blob, bottom_blob_padded, 0, cmd, opt);
+    if (ret != 0)
+        return ret;
+
+    return convolution->forward(bottom_blob_padded, top_blob, cmd, opt);
+}
+
+int ReflectConvolution::residual_add(const std::vector<ncnn::VkMat>& bottom_blobs, ncnn::VkMat& top_blob, ncnn::VkCompute& cmd, const ncnn::Option& opt) const
+{
+    const int elempack = top_blob.elempack;
+    const ncnn::Pipeline* pipeline = elempack == 4 ? pipeline_residual_add_pack4 : pipeline_residual_add;
+
+    // two residuals per pass
+    for (size_t r = 1; r < bottom_blobs.size(); r += 2)
+    {
+        const int residual_count = r + 1 < bottom_blobs.size() ? 2 : 1;
+
+        std::vector<ncnn::VkMat> bindings(3);
+        bindings[0] = top_blob;
+
+        for (int k = 0; k < residual_count; k++)
+        {
+            ncnn::VkMat residual = bottom_blobs[r + k];
+            if (residual.elempack != elempack)
+            {
+                vkdev->convert_packing(bottom_blobs[r + k], residual, elempack, cmd, opt);
+            }
+
+            bindings[1 + k] = residual;
+        }
+
+        // unused binding, never read
+        if (residual_count == 1)
+        {
+            bindings[2] = bindings[1];
+        }
+
+        std::vector<ncnn::vk_constant_type> constants(5);
+        constants[0].i = top_blob.w;
+        constants[1].i = top_blob.h;
+        constants[2].i = top_blob.c;
+        constants[3].i = top_blob.cstep;
+        constants[4].i = residual_count;
+
+        cmd.record_pipeline(pipeline, bindings, constants, top_blob);
+    }
+
+    return 0;
+}
+
+int ReflectConvolution::forward(const std::vector<ncnn::VkMat>& bottom_blobs, std::vector<ncnn::VkMat>& top_blobs, ncnn::VkCompute& cmd, const ncnn::Option& opt) const
+{
+    // the means of a tile are never read when the pooled blob is fed from gap_stats
+    const int epilogue = gap_epilogue && !gap_stats_fed;
+
+    ncnn::VkMat bottom_blob_padded;
+    ncnn::VkMat window_means;
+    int ret = reflect_pad(bottom_blobs[0], bottom_blob_padded, epilogue ? &window_means : 0, cmd, opt);
+    if (ret != 0)
+        return ret;
+
+    ret = convolution->forward(bottom_blob_padded, top_blobs[0], cmd, opt);
+    if (ret != 0)
+        return ret;
+
+    if (bottom_blobs.size() > 1)
+    {
+        ret = residual_add(bottom_blobs, top_blobs[0], cmd, opt);
+        if (ret != 0)
+            return ret;
+    }
+
+    if (!epilogue)
+        return 0;
+
+    // the convolution is linear, convolving the window means gives the output means
+    return convolution->forward(window_means, top_blobs[1], cmd, opt);
+}
+
+ChannelAttentionResidual::ChannelAttentionResidual()
+{
+    one_blob_only = false;
+    support_inplace = false;
+
+    fc1 = 0;
+    fc2 = 0;
+
+    pipeline_scale_add = 0;
+    pipeline_scale_add_pack4 = 0;
+}
+
+ChannelAttentionResidual::~ChannelAttentionResidual()
+{
+    delete fc1;
+    delete fc2;
+}
+
+int ChannelAttentionResidual::create_pipeline(const ncnn::Option& opt)
+{
+    // the inner product pipelines were created by the net already
+    if (!vkdev)
+        return 0;
+
+    CAIN_CREATE_PIPELINE(scale_add, 8, 8, 1)
+    CAIN_CREATE_PIPELINE(scale_add_pack4, 8, 8, 1)
+
+    return 0;
+}
+
+int ChannelAttentionResidual::destroy_pipeline(const ncnn::Option& opt)
+{
+    if (fc1)
+    {
+        fc1->destroy_pipeline(opt);
+    }
+
+    if (fc2)
+    {
+        fc2->destroy_pipeline(opt);
+    }
+
+    delete pipeline_scale_add;
+    pipeline_scale_add = 0;
+
+    delete pipeline_scale_add_pack4;
+    pipeline_scale_add_pack4 = 0;
+
+    return 0;
+}
+
+// top = bottom * scale + residual, scale is one value per channel
+template<typename S>
+static void scale_add_kernel(const ncnn::Mat& bottom_blob, const ncnn::Mat& scale, const ncnn::Mat& residual_blob, ncnn::Mat& top_blob, const ncnn::Option& opt)
+{
+    typedef typename S::type T;
+
+    const int channels = bottom_blob.c;
+    const int size = bottom_blob.w * bottom_blob.h;
+    const int elempack = bottom_blob.elempack;
+
+    // a packed 1d scale is still laid out in channel order, index it flat
+    const T* scaleptr = scale;
+
+    #pragma omp parallel for num_threads(opt.num_threads)
+    for (int q = 0; q < channels; q++)
+    {
+        const T* ptr = bottom_blob.channel(q);
+        const T* rptr = residual_blob.channel(q);
+        const T* sptr = scaleptr + q * elempack;
+        T* outptr = top_blob.channel(q);
+
+        float s[16];
+        for (int k = 0; k < elempack; k++)
+        {
+            s[k] = S::load(sptr[k]);
+        }
+
+        for (int i = 0; i < size; i++)
+        {
+            for (int k = 0; k < elempack; k++)
+            {
+                outptr[k] = S::store(S::load(ptr[k]) * s[k] + S::load(rptr[k]));
+            }
+
+            ptr += elempack;
+            rptr += elempack;
+            outptr += elempack;
+        }
+    }
+}
+
+int ChannelAttentionResidual::forward(const std::vector<ncnn::Mat>& bottom_blobs, std::vector<ncnn::Mat>& top_blobs, const ncnn::Option& opt) const
+{
+    const ncnn::Mat& bottom_blob = bottom_blobs[0];
+    const ncnn::Mat& pooled_blob = bottom_blobs[1];
+    const ncnn::Mat& residual_blob = bottom_blobs[2];
+
+    ncnn::Mat squeezed;
+    int ret = fc1->forward(pooled_blob, squeezed, opt);
+    if (ret != 0)
+        return ret;
+
+    ncnn::Mat scale;
+    ret = fc2->forward(squeezed, scale, opt);
+    if (ret != 0)
+        return ret;
+
+    ncnn::Mat& top_blob = top_blobs[0];
+    top_blob.create_like(bottom_blob, opt.blob_allocator);
+    if (top_blob.empty())
+        return -100;
+
+    const int storage = storage_type(bottom_blob, opt);
+
+    if (storage == STORAGE_FP16)
+        scale_add_kernel<fp16_storage>(bottom_blob, scale, residual_blob, top_blob, opt);
+    else if (storage == STORAGE_BF16)
+        scale_add_kernel<bf16_storage>(bottom_blob, scale, residual_blob, top_blob, opt);
+    else
+        scale_add_kernel<fp32_storage>(bottom_blob, scale, residual_blob, top_blob, opt);
+
+    return 0;
+}
+
+int ChannelAttentionResidual::forward(const std::vector<ncnn::VkMat>& bottom_blobs, std::vector<ncnn::VkMat>& top_blobs, ncnn::VkCompute& cmd, const ncnn::Option& opt) const
+{
+    const ncnn::VkMat& bottom_blob = bottom_blobs[0];
+    const ncnn::VkMat& pooled_blob = bottom_blobs[1];
+    const ncnn::VkMat& residual_blob = bottom_blobs[2];
+
+    ncnn::VkMat squeezed;
+    int ret = fc1->forward(pooled_blob, squeezed, cmd, opt);
+    if (ret != 0)
+        return ret;
+
+    ncnn::VkMat scale;
+    ret = fc2->forward(squeezed, scale, cmd, opt);
+    if (ret != 0)
+        return ret;
+
+    const int elempack = bottom_blob.elempack;
+
+    if (scale.elempack != elempack)
+    {
+        ncnn::VkMat scale_packed;
+        vkdev->convert_packing(scale, scale_packed, elempack, cmd, opt);
+        scale = scale_packed;
+    }
+
+    ncnn::VkMat& top_blob = top_blobs[0];
+    top_blob.create_like(bottom_blob, opt.blob_vkallocator);
+    if (top_blob.empty())
+        return -100;
+
+    std::vector<ncnn::VkMat> bindings(4);
+    bindings[0] = bottom_blob;
+    bindings[1] = scale;
+    bindings[2] = residual_blob;
+    bindings[3] = top_blob;
+
+    std::vector<ncnn::vk_constant_type> constants(4);
+    constants[0].i = top_blob.w;
+    constants[1].i = top_blob.h;
+    constants[2].i = top_blob.c;
+    constants[3].i = top_blob.cstep;
+
+    const ncnn::Pipeline* pipeline = elempack == 4 ? pipeline_scale_add_pack4 : pipeline_scale_add;
+
+    cmd.record_pipeline(pipeline, bindings, constants, top_blob);
+
+    return 0;
+}
+
+// ParamDict keeps its loaders to the net, reach them from a subclass
+class CAINParamDict : public ncnn::ParamDict
+{
+public:
+    int load(const ncnn::DataReader& dr)
+    {
+        return load_param(dr);
+    }
+
+    int load_bin(const ncnn::DataReader& dr)
+    {
+        return load_param_bin(dr);
+    }
+};
+
+int cain_load_layer_params(const unsigned char* param, int param_binary, std::vector<ncnn::ParamDict>& params)
+{
+    const unsigned char* mem = param;
+    ncnn::DataReaderFromMemory dr(mem);
+
+    // walk the same layout as Net::load_param and Net::load_param_bin, keeping only the params
+    int magic = 0;
+    int layer_count = 0;
+    int blob_count = 0;
+
+    if (param_binary)
+    {
+        dr.read(&magic, sizeof(int));
+        dr.read(&layer_count, sizeof(int));
+        dr.read(&blob_count, sizeof(int));
+    }
+    else
+    {
+        dr.scan("%d", &magic);
+        dr.scan("%d", &layer_count);
+        dr.scan("%d", &blob_count);
+    }
+
+    if (magic != 7767517 || layer_count <= 0)
+    {
+        fprintf(stderr, "cain_load_layer_params invalid param\n");
+        return -1;
+    }
+
+    params.resize(layer_count);
+
+    for (int i = 0; i < layer_count; i++)
+    {
+        int bottom_count = 0;
+        int top_count = 0;
+
+        if (param_binary)
+        {
+            int typeindex = 0;
+            dr.read(&typeindex, sizeof(int));
+            dr.read(&bottom_count, sizeof(int));
+            dr.read(&top_count, sizeof(int));
+
+            for (int j = 0; j < bottom_count + top_count; j++)
+            {
+                int blob_index = 0;
+                dr.read(&blob_index, sizeof(int));
+            }
+        }
+        else
+        {
+            char layer_type[256];
+            char layer_name[256];
+            dr.scan("%255s", layer_type);
+            dr.scan("%255s", layer_name);
+            dr.scan("%d", &bottom_count);
+            dr.scan("%d", &top_count);
+
+            for (int j = 0; j < bottom_count + top_count; j++)
+            {
+                char blob_name[256];
+                dr.scan("%255s", blob_name);
+            }
+        }
+
+        CAINParamDict pd;
+        int ret = param_binary ? pd.load_bin(dr) : pd.load(dr);
+        if (ret != 0)
+        {
+            fprintf(stderr, "cain_load_layer_params layer %d failed\n", i);
+            return -1;
+        }
+
+        params[i] = pd;
+    }
+
+    return 0;
+}
+
+// the replaced layers keep their slots so that layer and blob indices stay valid
+// a slot whose tops nobody consumes is never forwarded, the tombstone only fills it
+// a local class rather than ncnn Noop, which the bundled ncnn is built without
+class CAINTombstone : public ncnn::Layer
+{
+public:
+    CAINTombstone()
+    {
+        one_blob_only = true;
+        support_inplace = true;
+    }
+
+    virtual int forward_inplace(ncnn::Mat& /*bottom_top_blob*/, const ncnn::Option& /*opt*/) const
+    {
+        return 0;
+    }
+};
+
+static ncnn::Layer* create_tombstone(const ncnn::Layer* layer)
+{
+    ncnn::Layer* tombstone = new CAINTombstone;
+    tombstone->type = "Noop";
+    tombstone->name = layer->name;
+    tombstone->typeindex = ncnn::LayerType::Noop;
+
+    return tombstone;
+}
+
+// the fused layer can only take a storage or layout its inner layers take as well
+static void inherit_support(ncnn::Layer* fused, const ncnn::Layer* layer)
+{
+    fused->support_vulkan = layer->support_vulkan;
+    fused->support_packing = layer->support_packing;
+    fused->support_bf16_storage = layer->support_bf16_storage;
+    fused->support_fp16_storage = layer->support_fp16_storage;
+    fused->support_int8_storage = layer->support_int8_storage;
+    fused->featmask = layer->featmask;
+    fused->vkdev = layer->vkdev;
+}
+
+#if _WIN32
+static int fuse_reflect_convolution(ncnn::Net& net, const std::vector<ncnn::ParamDict>& params, const std::wstring& cachedir)
+#else
+static int fuse_reflect_convolution(ncnn::Net& net, const std::vector<ncnn::ParamDict>& params, const std::string& cachedir)
+#endif
+{
+    std::vector<ncnn::Layer*>& layers = net.mutable_layers();
+    std::vector<ncnn::Blob>& blobs = net.mutable_blobs();
+
+    int fused_count = 0;
+
+    for (size_t i = 0; i < layers.size(); i++)
+    {
+        if (layers[i]->typeindex != ncnn::LayerType::Padding)
+            continue;
+
+        // Padding top bottom left right type=reflect, no channel padding
+        const ncnn::ParamDict& pd = params[i];
+        const int top = pd.get(0, 0);
+        const int bottom = pd.get(1, 0);
+        const int left = pd.get(2, 0);
+        const int right = pd.get(3, 0);
+        const int type = pd.get(4, 0);
+        const int front = pd.get(7, 0);
+        const int behind = pd.get(8, 0);
+
+        if (type != 2 || top < 1 || bottom != top || left != top || right != top || front != 0 || behind != 0)
+            continue;
+
+        const int padded_blob = layers[i]->tops[0];
+        const int j = blobs[padded_blob].consumer;
+        if (j < 0 || layers[j]->typeindex != ncnn::LayerType::Convolution)
+            continue;
+
+        // convolution itself must not pad again
+        const ncnn::ParamDict& pd_conv = params[j];
+        const int pad_left = pd_conv.get(4, 0);
+        const int pad_right = pd_conv.get(15, pad_left);
+        const int pad_top = pd_conv.get(14, pad_left);
+        const int pad_bottom = pd_conv.get(16, pad_top);
+        if (pad_left != 0 || pad_right != 0 || pad_top != 0 || pad_bottom != 0)
+            continue;
+
+        ReflectConvolution* fused = new ReflectConvolution;
+        fused->type = "ReflectConvolution";
+        fused->name = layers[j]->name;
+        fused->typeindex = ncnn::LayerType::CustomBit | 1;
+        fused->bottoms = layers[i]->bottoms;
+        fused->tops = layers[j]->tops;
+        fused->pad = top;
+        fused->convolution = layers[j];
+        fused->cachedir = cachedir;
+        inherit_support(fused, layers[j]);
+
+        if (fused->create_pipeline(net.opt) != 0)
+        {
+            fused->convolution = 0;
+            delete fused;
+            continue;
+        }
+
+        ncnn::Layer* tombstone = create_tombstone(layers[i]);
+        layers[i]->destroy_pipeline(net.opt);
+        delete layers[i];
+
+        layers[i] = tombstone;
+        layers[j] = fused;
+
+        blobs[fused->bottoms[0]].consumer = j;
+        blobs[padded_blob].producer = -1;
+        blobs[padded_blob].consumer = -1;
+
+        fused_count++;
+    }
+
+    return fused_count;
+}
+
+#if _WIN32
+static int fuse_channel_attention_residual(ncnn::Net& net, const std::vector<ncnn::ParamDict>& params, const std::wstring& cachedir)
+#else
+static int fuse_channel_attention_residual(ncnn::Net& net, const std::vector<ncnn::ParamDict>& params, const std::string& cachedir)
+#endif
+{
+    std::vector<ncnn::Layer*>& layers = net.mutable_layers();
+    std::vector<ncnn::Blob>& blobs = net.mutable_blobs();
+
+    int fused_count = 0;
+
+    for (size_t i = 0; i < layers.size(); i++)
+    {
+        // Add(Mul(x, fc2(fc1(pooled))), residual)
+        if (layers[i]->typeindex != ncnn::LayerType::BinaryOp || layers[i]->bottoms.size() != 2)
+            continue;
+
+        if (params[i].get(0, 0) != 0 || params[i].get(1, 0) != 0)
+            continue;
+
+        int mul_index = -1;
+        int residual_blob = -1;
+        for (int k = 0; k < 2; k++)
+        {
+            const int producer = blobs[layers[i]->bottoms[k]].producer;
+            if (producer >= 0 && layers[producer]->typeindex == ncnn::LayerType::BinaryOp && layers[producer]->bottoms.size() == 2 && params[producer].get(0, 0) == 2 && params[producer].get(1, 0) == 0)
+            {
+                mul_index = producer;
+                residual_blob = layers[i]->bottoms[1 - k];
+                break;
+            }
+        }
+
+        if (mul_index < 0)
+            continue;
+
+        const ncnn::Layer* mul = layers[mul_index];
+
+        int fc2_index = -1;
+        int bottom_blob = -1;
+        for (int k = 0; k < 2; k++)
+        {
+            const int producer = blobs[mul->bottoms[k]].producer;
+            if (producer >= 0 && layers[producer]->typeindex == ncnn::LayerType::InnerProduct)
+            {
+                fc2_index = producer;
+                bottom_blob = mul->bottoms[1 - k];
+                break;
+            }
+        }
+
+        if (fc2_index < 0)
+            continue;
+
+        const int fc1_index = blobs[layers[fc2_index]->bottoms[0]].producer;
+        if (fc1_index < 0 || layers[fc1_index]->typeindex != ncnn::LayerType::InnerProduct)
+            continue;
+
+        // fc1 must read global average pooled channels
+        const int pooled_blob = layers[fc1_index]->bottoms[0];
+        const int pooling_index = blobs[pooled_blob].producer;
+        if (pooling_index < 0 || layers[pooling_index]->typeindex != ncnn::LayerType::Pooling)
+            continue;
+
+        if (params[pooling_index].get(0, 0) != 1 || params[pooling_index].get(4, 0) != 1)
+            continue;
+
+        ChannelAttentionResidual* fused = new ChannelAttentionResidual;
+        fused->type = "ChannelAttentionResidual";
+        fused->name = layers[i]->name;
+        fused->typeindex = ncnn::LayerType::CustomBit | 2;
+        fused->bottoms.resize(3);
+        fused->bottoms[0] = bottom_blob;
+        fused->bottoms[1] = pooled_blob;
+        fused->bottoms[2] = residual_blob;
+        fused->tops = layers[i]->tops;
+        fused->fc1 = layers[fc1_index];
+        fused->fc2 = layers[fc2_index];
+        fused->cachedir = cachedir;
+        inherit_support(fused, layers[i]);
+
+        // the pooled vector reaches fc1 in whatever layout and storage the fused layer takes
+        fused->support_packing = layers[i]->support_packing && fused->fc1->support_packing && fused->fc2->support_packing;
+        fused->support_bf16_storage = layers[i]->support_bf16_storage && fused->fc1->support_bf16_storage && fused->fc2->support_bf16_storage;
+        fused->support_fp16_storage = layers[i]->support_fp16_storage && fused->fc1->support_fp16_storage && fused->fc2->support_fp16_storage;
+
+        if (fused->create_pipeline(net.opt) != 0)
+        {
+            fused->fc1 = 0;
+            fused->fc2 = 0;
+            delete fused;
+            continue;
+        }
+
+        const int scale_blob = layers[fc2_index]->tops[0];
+        const int squeezed_blob = layers[fc1_index]->tops[0];
+        const int scaled_blob = mul->tops[0];
+
+        ncnn::Layer* mul_tombstone = create_tombstone(layers[mul_index]);
+        layers[mul_index]->destroy_pipeline(net.opt);
+        delete layers[mul_index];
+
+        layers[i]->destroy_pipeline(net.opt);
+        delete layers[i];
+
+        // the add slot runs last of the four, keep the fused layer there
+        layers[mul_index] = mul_tombstone;
+        layers[fc2_index] = create_tombstone(fused->fc2);
+        layers[fc1_index] = create_tombstone(fused->fc1);
+        layers[i] = fused;
+
+        blobs[bottom_blob].consumer = i;
+        blobs[pooled_blob].consumer = i;
+        blobs[residual_blob].consumer = i;
+
+        blobs[squeezed_blob].producer = -1;
+        blobs[squeezed_blob].consumer = -1;
+        blobs[scale_blob].producer = -1;
+        blobs[scale_blob].consumer = -1;
+        blobs[scaled_blob].producer = -1;
+        blobs[scaled_blob].consumer = -1;
+
+        fused_count++;
+    }
+
+    return fused_count;
+}
+
+static int fuse_gap_epilogue(ncnn::Net& net, const std::vector<ncnn::ParamDict>& params)
+{
+    std::vector<ncnn::Layer*>& layers = net.mutable_layers();
+    std::vector<ncnn::Blob>& blobs = net.mutable_blobs();
+
+    int fused_count = 0;
+
+    for (size_t i = 0; i < layers.size(); i++)
+    {
+        // ReflectConvolution -> Split -> global average Pooling
+        if (layers[i]->typeindex != ncnn::LayerType::Pooling)
+            continue;
+
+        if (params[i].get(0, 0) != 1 || params[i].get(4, 0) != 1)
+            continue;
+
+        const int pooling_bottom_blob = layers[i]->bottoms[0];
+        const int split_index = blobs[pooling_bottom_blob].producer;
+        if (split_index < 0 || layers[split_index]->typeindex != ncnn::LayerType::Split || layers[split_index]->tops.size() != 2)
+            continue;
+
+        const int conv_top_blob = layers[split_index]->bottoms[0];
+        const int conv_index = blobs[conv_top_blob].producer;
+        if (conv_index < 0 || layers[conv_index]->typeindex != (ncnn::LayerType::CustomBit | 1))
+            continue;
+
+        ReflectConvolution* rc = (ReflectConvolution*)layers[conv_index];
+        if (rc->pad != 1 || rc->gap_epilogue)
+            continue;
+
+        // same size output and no activation or requantize, mean(conv(x)) == conv(mean(x))
+        const ncnn::ParamDict& pd_conv = params[conv_index];
+        const int kernel_w = pd_conv.get(1, 0);
+        const int kernel_h = pd_conv.get(11, kernel_w);
+        const int dilation_w = pd_conv.get(2, 1);
+        const int dilation_h = pd_conv.get(12, dilation_w);
+        const int stride_w = pd_conv.get(3, 1);
+        const int stride_h = pd_conv.get(13, stride_w);
+        const int int8_scale_term = pd_conv.get(8, 0);
+        const int activation_type = pd_conv.get(9, 0);
+        if (kernel_w != 3 || kernel_h != 3 || dilation_w != 1 || dilation_h != 1 || stride_w != 1 || stride_h != 1 || int8_scale_term != 0 || activation_type != 0)
+            continue;
+
+        const int feature_blob = layers[split_index]->tops[0] == pooling_bottom_blob ? layers[split_index]->tops[1] : layers[split_index]->tops[0];
+        const int pooled_blob = layers[i]->tops[0];
+
+        // the channel means get their own blob, the pooling slot flattens it into the original pooled blob
+        // so the pooled blob keeps a single-top producer that tile mode can override
+        ncnn::Layer* flatten = ncnn::create_layer(ncnn::LayerType::Flatten);
+        if (!flatten)
+        {
+            fprintf(stderr, "cain_fuse_layers needs ncnn built with the Flatten layer\n");
+            return -1;
+        }
+
+        flatten->type = "Flatten";
+        flatten->name = layers[i]->name;
+        flatten->typeindex = ncnn::LayerType::Flatten;
+        flatten->vkdev = layers[i]->vkdev;
+        flatten->featmask = layers[i]->featmask;
+
+        ncnn::ParamDict pd;
+        flatten->load_param(pd);
+
+        if (flatten->create_pipeline(net.opt) != 0)
+        {
+            delete flatten;
+            continue;
+        }
+
+        rc->gap_epilogue = 1;
+        if (rc->create_pipeline(net.opt) != 0)
+        {
+            rc->gap_epilogue = 0;
+            flatten->destroy_pipeline(net.opt);
+            delete flatten;
+            continue;
+        }
+
+        const int means_blob = (int)blobs.size();
+        ncnn::Blob blob;
+        blob.name = rc->name + "_gap";
+        blob.producer = conv_index;
+        blob.consumer = (int)i;
+        blobs.push_back(blob);
+
+        flatten->bottoms.resize(1);
+        flatten->bottoms[0] = means_blob;
+        flatten->tops = layers[i]->tops;
+
+        rc->one_blob_only = false;
+        rc->tops.resize(2);
+        rc->tops[0] = feature_blob;
+        rc->tops[1] = means_blob;
+
+        ncnn::Layer* split_tombstone = create_tombstone(layers[split_index]);
+        layers[split_index]->destroy_pipeline(net.opt);
+        delete layers[split_index];
+        layers[split_index] = split_tombstone;
+
+        layers[i]->destroy_pipeline(net.opt);
+        delete layers[i];
+        layers[i] = flatten;
+
+        blobs[feature_blob].producer = conv_index;
+        blobs[pooled_blob].producer = (int)i;
+
+        blobs[conv_top_blob].producer = -1;
+        blobs[conv_top_blob].consumer = -1;
+        blobs[pooling_bottom_blob].producer = -1;
+        blobs[pooling_bottom_blob].consumer = -1;
+
+        fused_count++;
+    }
+
+    return fused_count;
+}
+
+static int fuse_residual_add(ncnn::Net& net, const std::vector<ncnn::ParamDict>& params)
+{
+    std::vector<ncnn::Layer*>& layers = net.mutable_layers();
+    std::vector<ncnn::Blob>& blobs = net.mutable_blobs();
+
+    int fused_count = 0;
+
+    for (size_t i = 0; i < layers.size(); i++)
+    {
+        if (layers[i]->typeindex != (ncnn::LayerType::CustomBit | 1))
+            continue;
+
+        ReflectConvolution* rc = (ReflectConvolution*)layers[i];
+        if (rc->gap_epilogue)
+            continue;
+
+        // ReflectConvolution -> Add -> Add ..., each with one more residual
+        std::vector<int> add_indexes;
+        while (rc->bottoms.size() < 5)
+        {
+            const int top_blob = rc->tops[0];
+            const int add_index = blobs[top_blob].consumer;
+            if (add_index < 0 || layers[add_index]->typeindex != ncnn::LayerType::BinaryOp || layers[add_index]->bottoms.size() != 2)
+                break;
+
+            if (params[add_index].get(0, 0) != 0 || params[add_index].get(1, 0) != 0)
+                break;
+
+            const ncnn::Layer* add = layers[add_index];
+            const int residual_blob = add->bottoms[0] == top_blob ? add->bottoms[1] : add->bottoms[0];
+            if (residual_blob == top_blob)
+                break;
+
+            rc->bottoms.push_back(residual_blob);
+            rc->tops[0] = add->tops[0];
+
+            blobs[residual_blob].consumer = (int)i;
+            blobs[add->tops[0]].producer = (int)i;
+            blobs[top_blob].producer = -1;
+            blobs[top_blob].consumer = -1;
+
+            add_indexes.push_back(add_index);
+        }
+
+        if (add_indexes.empty())
+            continue;
+
+        rc->one_blob_only = false;
+
+        rc->create_pipeline(net.opt);
+
+        for (size_t k = 0; k < add_indexes.size(); k++)
+        {
+            const int add_index = add_indexes[k];
+
+            ncnn::Layer* tombstone = create_tombstone(layers[add_index]);
+            layers[add_index]->destroy_pipeline(net.opt);
+            delete layers[add_index];
+            layers[add_index] = tombstone;
+        }
+
+        fused_count++;
+    }
+
+    return fused_count;
+}
+
+static int gcd(int a, int b)
+{
+    while (b)
+    {
+        int t = a % b;
+        a = b;
+        b = t;
+    }
+
+    return a;
+}
+
+int cain_input_alignment(const ncnn::Net& net, const std::vector<ncnn::ParamDict>& params)
+{
+    const std::vector<ncnn::Layer*>& layers = net.layers();
+    const std::vector<ncnn::Blob>& blobs = net.blobs();
+
+    if (params.size() != layers.size())
+        return -1;
+
+    // how many input pixels one element of each blob spans, 0 once there is no spatial extent left
+    std::vector<int> scales(blobs.size(), 1);
+
+    int alignment = 1;
+
+    for (size_t i = 0; i < layers.size(); i++)
+    {
+        const ncnn::Layer* layer = layers[i];
+        const ncnn::ParamDict& pd = params[i];
+
+        int scale = layer->bottoms.empty() ? 1 : 0;
+        for (size_t j = 0; j < layer->bottoms.size(); j++)
+        {
+            scale = std::max(scale, scales[layer->bottoms[j]]);
+        }
+
+        if (scale != 0)
+        {
+            switch (layer->typeindex)
+            {
+            case ncnn::LayerType::Reorg:
+                scale *= pd.get(0, 1);
+                break;
+            case ncnn::LayerType::Convolution:
+            case ncnn::LayerType::ConvolutionDepthWise:
+            {
+                const int stride_w = pd.get(3, 1);
+                const int stride_h = pd.get(13, stride_w);
+                scale *= std::max(stride_w, stride_h);
+                break;
+            }
+            case ncnn::LayerType::Pooling:
+            {
+                const int stride_w = pd.get(2, 1);
+                const int stride_h = pd.get(12, stride_w);
+                scale = pd.get(4, 0) ? 0 : scale * std::max(stride_w, stride_h);
+                break;
+            }
+            case ncnn::LayerType::PixelShuffle:
+                scale = std::max(scale / pd.get(0, 1), 1);
+                break;
+            case ncnn::LayerType::Deconvolution:
+            case ncnn::LayerType::DeconvolutionDepthWise:
+            {
+                const int stride_w = pd.get(3, 1);
+                const int stride_h = pd.get(13, stride_w);
+                scale = std::max(scale / std::max(stride_w, stride_h), 1);
+                break;
+            }
+            case ncnn::LayerType::InnerProduct:
+            case ncnn::LayerType::Flatten:
+            case ncnn::LayerType::Reshape:
+                scale = 0;
+                break;
+            default:
+                break;
+            }
+        }
+
+        for (size_t j = 0; j < layer->tops.size(); j++)
+        {
+            scales[layer->tops[j]] = scale;
+        }
+
+        if (scale != 0)
+        {
+            alignment = alignment / gcd(alignment, scale) * scale;
+        }
+    }
+
+    return alignment;
+}
+
+#if _WIN32
+int cain_fuse_layers(ncnn::Net& net, const std::vector<ncnn::ParamDict>& params, const std::wstring& cachedir)
+#else
+int cain_fuse_layers(ncnn::Net& net, const std::vector<ncnn::ParamDict>& params, const std::string& cachedir)
+#endif
+{
+    if (params.size() != net.layers().size())
+    {
+        fprintf(stderr, "cain_fuse_layers param does not match the net\n");
+        return -1;
+    }
+
+    // a pass that fails has not touched the net, the ones before it leave a valid graph
+    if (fuse_reflect_convolution(net, params, cachedir) < 0)
+        return -1;
+
+    if (fuse_channel_attention_residual(net, params, cachedir) < 0)
+        return -1;
+
+    if (fuse_gap_epilogue(net, params) < 0)
+        return -1;
+
+    if (fuse_residual_add(net, params) < 0)
+        return -1;
+
+    return 0;
+}
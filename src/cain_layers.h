@@ -0,0 +1,122 @@
+// cain implemented with ncnn library
+
+#ifndef CAIN_LAYERS_H
+#define CAIN_LAYERS_H
+
+#include <string>
+#include <vector>
+
+// ncnn
+#include "net.h"
+#include "layer.h"
+#include "paramdict.h"
+
+// 3x3 convolution on a reflect padded input, replaces Padding(4=2) -> Convolution
+// the padded copy only lives in the workspace for the duration of the convolution
+// with gap_epilogue the layer also outputs the channel means of its output as a second 1x1xc top
+// any bottoms after the first are residuals added in place into the output, replacing the following Adds
+class ReflectConvolution : public ncnn::Layer
+{
+public:
+    ReflectConvolution();
+    virtual ~ReflectConvolution();
+
+    virtual int create_pipeline(const ncnn::Option& opt);
+    virtual int destroy_pipeline(const ncnn::Option& opt);
+
+    virtual int forward(const ncnn::Mat& bottom_blob, ncnn::Mat& top_blob, const ncnn::Option& opt) const;
+    virtual int forward(const std::vector<ncnn::Mat>& bottom_blobs, std::vector<ncnn::Mat>& top_blobs, const ncnn::Option& opt) const;
+
+    virtual int forward(const ncnn::VkMat& bottom_blob, ncnn::VkMat& top_blob, ncnn::VkCompute& cmd, const ncnn::Option& opt) const;
+    virtual int forward(const std::vector<ncnn::VkMat>& bottom_blobs, std::vector<ncnn::VkMat>& top_blobs, ncnn::VkCompute& cmd, const ncnn::Option& opt) const;
+
+protected:
+    // reflect pad into the workspace, optionally with the k x k window means the convolution taps see
+    int reflect_pad(const ncnn::Mat& bottom_blob, ncnn::Mat& bottom_blob_padded, ncnn::Mat* window_means, const ncnn::Option& opt) const;
+    int reflect_pad(const ncnn::VkMat& bottom_blob, ncnn::VkMat& bottom_blob_padded, ncnn::VkMat* window_means, ncnn::VkCompute& cmd, const ncnn::Option& opt) const;
+
+    // top_blob += bottom_blobs[1] + bottom_blobs[2] ...
+    int residual_add(const std::vector<ncnn::Mat>& bottom_blobs, ncnn::Mat& top_blob, const ncnn::Option& opt) const;
+    int residual_add(const std::vector<ncnn::VkMat>& bottom_blobs, ncnn::VkMat& top_blob, ncnn::VkCompute& cmd, const ncnn::Option& opt) const;
+
+public:
+    // reflect border on each side
+    int pad;
+
+    // emit the global average pool of the output, the convolution must be linear
+    int gap_epilogue;
+
+    // the original convolution layer, owned
+    ncnn::Layer* convolution;
+
+    ncnn::Pipeline* pipeline_reflect_pad;
+    ncnn::Pipeline* pipeline_reflect_pad_pack4;
+    ncnn::Pipeline* pipeline_reflect_pad_rowsum;
+    ncnn::Pipeline* pipeline_reflect_pad_rowsum_pack4;
+    ncnn::Pipeline* pipeline_window_mean;
+    ncnn::Pipeline* pipeline_window_mean_pack4;
+    ncnn::Pipeline* pipeline_residual_add;
+    ncnn::Pipeline* pipeline_residual_add_pack4;
+
+    // spirv cache directory, empty to compile on every start
+#if _WIN32
+    std::wstring cachedir;
+#else
+    std::string cachedir;
+#endif
+};
+
+// tail of the residual channel attention block, replaces
+// InnerProduct(ReLU) -> InnerProduct(Sigmoid) -> BinaryOp Mul -> BinaryOp Add
+// bottoms are the feature, its pooled channel means and the residual
+// the pooling itself stays a separate layer so that tile mode can feed frame-level means
+class ChannelAttentionResidual : public ncnn::Layer
+{
+public:
+    ChannelAttentionResidual();
+    virtual ~ChannelAttentionResidual();
+
+    virtual int create_pipeline(const ncnn::Option& opt);
+    virtual int destroy_pipeline(const ncnn::Option& opt);
+
+    virtual int forward(const std::vector<ncnn::Mat>& bottom_blobs, std::vector<ncnn::Mat>& top_blobs, const ncnn::Option& opt) const;
+
+    virtual int forward(const std::vector<ncnn::VkMat>& bottom_blobs, std::vector<ncnn::VkMat>& top_blobs, ncnn::VkCompute& cmd, const ncnn::Option& opt) const;
+
+public:
+    // the original squeeze and excite inner product layers, owned
+    ncnn::Layer* fc1;
+    ncnn::Layer* fc2;
+
+    ncnn::Pipeline* pipeline_scale_add;
+    ncnn::Pipeline* pipeline_scale_add_pack4;
+
+    // spirv cache directory, empty to compile on every start
+#if _WIN32
+    std::wstring cachedir;
+#else
+    std::string cachedir;
+#endif
+};
+
+// tile passes feed the pooled blobs from the statistics of the whole frame, set fed around their extract calls
+// ReflectConvolution on the calling thread then skips the channel means nobody reads
+void cain_set_gap_stats_fed(int fed);
+
+// per-layer params of the loaded graph, in the same order as net.layers()
+// ncnn does not keep them around in a form we can read back
+int cain_load_layer_params(const unsigned char* param, int param_binary, std::vector<ncnn::ParamDict>& params);
+
+// the input size the graph needs to be a multiple of, from the strides of Reorg, Convolution and Pooling
+// and the upscale of PixelShuffle along every path, call before cain_fuse_layers
+int cain_input_alignment(const ncnn::Net& net, const std::vector<ncnn::ParamDict>& params);
+
+// rewrite the loaded cainnet graph with the fused layers above, call after load_model
+// params are the per-layer params from cain_load_layer_params, the fused shaders are cached in cachedir
+#if _WIN32
+int cain_fuse_layers(ncnn::Net& net, const std::vector<ncnn::ParamDict>& params, const std::wstring& cachedir);
+#else
+int cain_fuse_layers(ncnn::Net& net, const std::vector<ncnn::ParamDict>& params, const std::string& cachedir);
+#endif
+
+#endif // CAIN_LAYERS_H
@@ -0,0 +1,674 @@
+// cain implemented with ncnn library
+
+// post-training int8 calibration of the cain model
+// runs representative frame pairs through the fp32 graph, collects the input ranges of the wide convolutions
+// and writes a table that ncnn2int8 turns into cain-int8.param and cain-int8.bin
+//
+//   cain-calibrate -i frames -m cain -o cain.table
+//   ncnn2int8 cain/cain.param cain/cain.bin cain/cain-int8.param cain/cain-int8.bin cain.table
+
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <clocale>
+
+#if _WIN32
+// image decoder with wic
+#include "wic_image.h"
+#else // _WIN32
+// image decoder with stb
+#define STB_IMAGE_IMPLEMENTATION
+#define STBI_NO_PSD
+#define STBI_NO_TGA
+#define STBI_NO_GIF
+#define STBI_NO_HDR
+#define STBI_NO_PIC
+#define STBI_NO_STDIO
+#include "stb_image.h"
+#endif // _WIN32
+#include "webp_image.h"
+
+#if _WIN32
+#include <wchar.h>
+static wchar_t* optarg = NULL;
+static int optind = 1;
+static wchar_t getopt(int argc, wchar_t* const argv[], const wchar_t* optstring)
+{
+    if (optind >= argc || argv[optind][0] != L'-')
+        return -1;
+
+    wchar_t opt = argv[optind][1];
+    const wchar_t* p = wcschr(optstring, opt);
+    if (p == NULL)
+        return L'?';
+
+    optarg = NULL;
+
+    if (p[1] == L':')
+    {
+        optind++;
+        if (optind >= argc)
+            return L'?';
+
+        optarg = argv[optind];
+    }
+
+    optind++;
+
+    return opt;
+}
+#else // _WIN32
+#include <unistd.h> // getopt()
+#endif // _WIN32
+
+// ncnn
+#include "cpu.h"
+#include "net.h"
+#include "layer_type.h"
+#include "layer/convolution.h"
+
+#include "cain_cpu.h"
+#include "cain_layers.h"
+
+#include "filesystem_utils.h"
+
+// convolutions narrower than this on either side stay fp32, the 3-channel head and tail are the sensitive ones
+static const int CALIBRATE_MIN_CHANNELS = 64;
+
+static const int HISTOGRAM_BINS = 2048;
+static const int QUANTIZE_BINS = 128;
+
+static void print_usage()
+{
+    fprintf(stderr, "Usage: cain-calibrate -i indir -o table [options]...\n\n");
+    fprintf(stderr, "  -h                   show this help\n");
+    fprintf(stderr, "  -i input-path        directory of consecutive frames (jpg/png/webp)\n");
+    fprintf(stderr, "  -o output-path       calibration table for ncnn2int8 (default=cain.table)\n");
+    fprintf(stderr, "  -m model-path        cain model path (default=cain)\n");
+    fprintf(stderr, "  -n pair-count        frame pairs to sample evenly from input-path (default=64)\n");
+    fprintf(stderr, "  -j thread-count      thread count (default=cpu count)\n");
+}
+
+static int decode_image(const path_t& imagepath, ncnn::Mat& image, int* webp)
+{
+    *webp = 0;
+
+    unsigned char* pixeldata = 0;
+    int w;
+    int h;
+    int c;
+
+#if _WIN32
+    FILE* fp = _wfopen(imagepath.c_str(), L"rb");
+#else
+    FILE* fp = fopen(imagepath.c_str(), "rb");
+#endif
+    if (fp)
+    {
+        // read whole file
+        unsigned char* filedata = 0;
+        int length = 0;
+        {
+            fseek(fp, 0, SEEK_END);
+            length = ftell(fp);
+            rewind(fp);
+            filedata = (unsigned char*)malloc(length);
+            if (filedata)
+            {
+                fread(filedata, 1, length, fp);
+            }
+            fclose(fp);
+        }
+
+        if (filedata)
+        {
+            pixeldata = webp_load(filedata, length, &w, &h, &c);
+            if (pixeldata)
+            {
+                *webp = 1;
+            }
+            else
+            {
+                // not webp, try jpg png etc.
+#if _WIN32
+                pixeldata = wic_decode_image(imagepath.c_str(), &w, &h, &c);
+#else // _WIN32
+                pixeldata = stbi_load_from_memory(filedata, length, &w, &h, &c, 3);
+                c = 3;
+#endif // _WIN32
+            }
+
+            free(filedata);
+        }
+    }
+
+    if (!pixeldata)
+    {
+#if _WIN32
+        fwprintf(stderr, L"decode image %ls failed\n", imagepath.c_str());
+#else // _WIN32
+        fprintf(stderr, "decode image %s failed\n", imagepath.c_str());
+#endif // _WIN32
+
+        return -1;
+    }
+
+    image = ncnn::Mat(w, h, (void*)pixeldata, (size_t)3, 3);
+
+    return 0;
+}
+
+static void free_image(ncnn::Mat& image, int webp)
+{
+    unsigned char* pixeldata = (unsigned char*)image.data;
+    if (webp == 1)
+    {
+        free(pixeldata);
+    }
+    else
+    {
+#if _WIN32
+        free(pixeldata);
+#else
+        stbi_image_free(pixeldata);
+#endif
+    }
+
+    image.release();
+}
+
+static FILE* open_file(const path_t& path, const char* mode)
+{
+#if _WIN32
+    wchar_t wmode[8];
+    swprintf(wmode, 8, L"%hs", mode);
+    return _wfopen(path.c_str(), wmode);
+#else
+    return fopen(path.c_str(), mode);
+#endif
+}
+
+// absolute value histogram of one convolution input
+// the range doubles by merging bin pairs whenever a larger value shows up, so one pass over the frames is enough
+class ActivationStat
+{
+public:
+    ActivationStat()
+    {
+        range = 0.f;
+        histogram.resize(HISTOGRAM_BINS, 0.0);
+    }
+
+    void update(const ncnn::Mat& m)
+    {
+        const int channels = m.c;
+        const int size = m.w * m.h;
+
+        float absmax = 0.f;
+        for (int q = 0; q < channels; q++)
+        {
+            const float* ptr = m.channel(q);
+            for (int i = 0; i < size; i++)
+            {
+                absmax = std::max(absmax, fabsf(ptr[i]));
+            }
+        }
+
+        if (absmax == 0.f)
+            return;
+
+        if (range == 0.f)
+        {
+            range = absmax;
+        }
+
+        while (range < absmax)
+        {
+            for (int i = 0; i < HISTOGRAM_BINS / 2; i++)
+            {
+                histogram[i] = histogram[i * 2] + histogram[i * 2 + 1];
+            }
+            for (int i = HISTOGRAM_BINS / 2; i < HISTOGRAM_BINS; i++)
+            {
+                histogram[i] = 0.0;
+            }
+
+            range *= 2.f;
+        }
+
+        const float bin_scale = HISTOGRAM_BINS / range;
+        for (int q = 0; q < channels; q++)
+        {
+            const float* ptr = m.channel(q);
+            for (int i = 0; i < size; i++)
+            {
+                // zeros are mostly relu output and would drown the distribution
+                if (ptr[i] == 0.f)
+                    continue;
+
+                const int index = std::min((int)(fabsf(ptr[i]) * bin_scale), HISTOGRAM_BINS - 1);
+                histogram[index] += 1.0;
+            }
+        }
+    }
+
+    // the clipping threshold whose 128-level quantized distribution is closest to the observed one
+    float threshold() const
+    {
+        if (range == 0.f)
+            return 0.f;
+
+        double kl_min = DBL_MAX;
+        int best = HISTOGRAM_BINS - 1;
+
+        for (int t = QUANTIZE_BINS; t < HISTOGRAM_BINS; t++)
+        {
+            std::vector<double> p(histogram.begin(), histogram.begin() + t);
+            for (int i = t; i < HISTOGRAM_BINS; i++)
+            {
+                p[t - 1] += histogram[i];
+            }
+
+            // merge into QUANTIZE_BINS levels and expand back over the nonzero bins
+            std::vector<double> q(t, 0.0);
+            const float ratio = (float)t / QUANTIZE_BINS;
+            for (int j = 0; j < QUANTIZE_BINS; j++)
+            {
+                const int start = (int)(j * ratio);
+                const int end = j == QUANTIZE_BINS - 1 ? t : (int)((j + 1) * ratio);
+
+                double sum = 0.0;
+                int nonzero = 0;
+                for (int k = start; k < end; k++)
+                {
+                    sum += p[k];
+                    nonzero += p[k] != 0.0 ? 1 : 0;
+                }
+
+                if (nonzero == 0)
+                    continue;
+
+                for (int k = start; k < end; k++)
+                {
+                    if (p[k] != 0.0)
+                        q[k] = sum / nonzero;
+                }
+            }
+
+            double p_sum = 0.0;
+            double q_sum = 0.0;
+            for (int k = 0; k < t; k++)
+            {
+                p_sum += p[k];
+                q_sum += q[k];
+            }
+
+            if (p_sum == 0.0 || q_sum == 0.0)
+                continue;
+
+            double kl = 0.0;
+            for (int k = 0; k < t; k++)
+            {
+                if (p[k] == 0.0)
+                    continue;
+
+                const double pk = p[k] / p_sum;
+                const double qk = q[k] / q_sum;
+                kl += pk * log(pk / qk);
+            }
+
+            if (kl < kl_min)
+            {
+                kl_min = kl;
+                best = t;
+            }
+        }
+
+        return (best + 0.5f) * range / HISTOGRAM_BINS;
+    }
+
+public:
+    float range;
+    // counts, double so that millions of hits per bin still add up
+    std::vector<double> histogram;
+};
+
+#if _WIN32
+int wmain(int argc, wchar_t** argv)
+#else
+int main(int argc, char** argv)
+#endif
+{
+    path_t inputpath;
+    path_t outputpath = PATHSTR("cain.table");
+    path_t model = PATHSTR("cain");
+    int pair_count = 64;
+    int num_threads = ncnn::get_cpu_count();
+
+#if _WIN32
+    setlocale(LC_ALL, "");
+    wchar_t opt;
+    while ((opt = getopt(argc, argv, L"i:o:m:n:j:h")) != (wchar_t)-1)
+    {
+        switch (opt)
+        {
+        case L'i':
+            inputpath = optarg;
+            break;
+        case L'o':
+            outputpath = optarg;
+            break;
+        case L'm':
+            model = optarg;
+            break;
+        case L'n':
+            pair_count = _wtoi(optarg);
+            break;
+        case L'j':
+            num_threads = _wtoi(optarg);
+            break;
+        case L'h':
+        default:
+            print_usage();
+            return -1;
+        }
+    }
+#else // _WIN32
+    int opt;
+    while ((opt = getopt(argc, argv, "i:o:m:n:j:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'i':
+            inputpath = optarg;
+            break;
+        case 'o':
+            outputpath = optarg;
+            break;
+        case 'm':
+            model = optarg;
+            break;
+        case 'n':
+            pair_count = atoi(optarg);
+            break;
+        case 'j':
+            num_threads = atoi(optarg);
+            break;
+        case 'h':
+        default:
+            print_usage();
+            return -1;
+        }
+    }
+#endif // _WIN32
+
+    if (inputpath.empty() || !path_is_directory(inputpath))
+    {
+        print_usage();
+        return -1;
+    }
+
+    if (pair_count < 1 || num_threads < 1)
+    {
+        fprintf(stderr, "invalid pair count or thread count argument\n");
+        return -1;
+    }
+
+    std::vector<path_t> filenames;
+    if (list_directory(inputpath, filenames) != 0)
+        return -1;
+
+    if (filenames.size() < 2)
+    {
+        fprintf(stderr, "at least two frames are needed\n");
+        return -1;
+    }
+
+    const path_t modeldir = sanitize_dirpath(model);
+
+    // the unfused fp32 graph, the original convolution weights stay around for the weight scales
+    ncnn::Net net;
+    net.opt.num_threads = num_threads;
+    net.opt.use_vulkan_compute = false;
+    net.opt.use_fp16_packed = false;
+    net.opt.use_fp16_storage = false;
+    net.opt.use_fp16_arithmetic = false;
+    net.opt.use_bf16_storage = false;
+    net.opt.lightmode = false;
+
+    // text param, ncnn2int8 matches the table by layer name
+    std::string param;
+    {
+        FILE* fp = open_file(modeldir + PATHSTR("/cain.param"), "rb");
+        if (!fp)
+        {
+            fprintf(stderr, "open cain.param failed\n");
+            return -1;
+        }
+
+        fseek(fp, 0, SEEK_END);
+        const long length = ftell(fp);
+        rewind(fp);
+
+        param.resize(length);
+        fread(&param[0], 1, length, fp);
+        fclose(fp);
+    }
+
+    {
+        FILE* fp = open_file(modeldir + PATHSTR("/cain.bin"), "rb");
+        if (!fp)
+        {
+            fprintf(stderr, "open cain.bin failed\n");
+            return -1;
+        }
+
+        int ret = net.load_param_mem(param.c_str());
+        if (ret == 0)
+        {
+            ret = net.load_model(fp);
+        }
+        fclose(fp);
+
+        if (ret != 0)
+        {
+            fprintf(stderr, "load cain model failed\n");
+            return -1;
+        }
+    }
+
+    std::vector<ncnn::ParamDict> params;
+    cain_load_layer_params((const unsigned char*)param.c_str(), 0, params);
+
+    const std::vector<ncnn::Layer*>& layers = net.layers();
+
+    int in0_reorg_blob = -1;
+    int in1_reorg_blob = -1;
+    int reorg_stride = 8;
+    std::vector<int> conv_indexes;
+    for (size_t i = 0; i < layers.size() && i < params.size(); i++)
+    {
+        const ncnn::Layer* layer = layers[i];
+
+        if (layer->typeindex == ncnn::LayerType::Reorg)
+        {
+            if (in0_reorg_blob == -1)
+            {
+                in0_reorg_blob = layer->tops[0];
+                reorg_stride = params[i].get(0, 1);
+            }
+            else
+            {
+                in1_reorg_blob = layer->tops[0];
+            }
+        }
+
+        if (layer->typeindex == ncnn::LayerType::Convolution)
+        {
+            const ncnn::ParamDict& pd = params[i];
+            const int num_output = pd.get(0, 0);
+            const int kernel_w = pd.get(1, 0);
+            const int kernel_h = pd.get(11, kernel_w);
+            const int weight_data_size = pd.get(6, 0);
+            const int num_input = num_output * kernel_w * kernel_h > 0 ? weight_data_size / (num_output * kernel_w * kernel_h) : 0;
+
+            if (num_output >= CALIBRATE_MIN_CHANNELS && num_input >= CALIBRATE_MIN_CHANNELS)
+                conv_indexes.push_back((int)i);
+        }
+    }
+
+    if (in1_reorg_blob == -1 || conv_indexes.empty())
+    {
+        fprintf(stderr, "unexpected cain model structure\n");
+        return -1;
+    }
+
+    int padding_alignment = cain_input_alignment(net, params);
+    if (padding_alignment <= 0)
+    {
+        padding_alignment = 32;
+    }
+
+    std::vector<ActivationStat> stats(conv_indexes.size());
+
+    // pairs spread evenly over the sequence so that every scene gets a say
+    const int count = (int)filenames.size();
+    const int pairs = std::min(pair_count, count - 1);
+    for (int p = 0; p < pairs; p++)
+    {
+        const int sx = pairs == 1 ? 0 : (int)((long long)p * (count - 2) / (pairs - 1));
+
+        ncnn::Mat in0image;
+        ncnn::Mat in1image;
+        int webp0 = 0;
+        int webp1 = 0;
+        if (decode_image(inputpath + PATHSTR('/') + filenames[sx], in0image, &webp0) != 0)
+            continue;
+
+        if (decode_image(inputpath + PATHSTR('/') + filenames[sx + 1], in1image, &webp1) != 0)
+        {
+            free_image(in0image, webp0);
+            continue;
+        }
+
+        if (in0image.w != in1image.w || in0image.h != in1image.h)
+        {
+            fprintf(stderr, "frame size mismatch, pair %d skipped\n", sx);
+            free_image(in0image, webp0);
+            free_image(in1image, webp1);
+            continue;
+        }
+
+        const int w = in0image.w;
+        const int h = in0image.h;
+        // as CAIN::padded_size, at least two elements of the smallest feature map
+        const int w_padded = std::max((w + padding_alignment - 1) / padding_alignment * padding_alignment, padding_alignment * 2);
+        const int h_padded = std::max((h + padding_alignment - 1) / padding_alignment * padding_alignment, padding_alignment * 2);
+
+        float in0mean[3];
+        float in1mean[3];
+        cain_image_mean((const unsigned char*)in0image.data, w, h, in0mean);
+        cain_image_mean((const unsigned char*)in1image.data, w, h, in1mean);
+
+#if _WIN32
+        const int bgr = 1;
+        const float in0mean_ordered[3] = {in0mean[2], in0mean[1], in0mean[0]};
+        const float in1mean_ordered[3] = {in1mean[2], in1mean[1], in1mean[0]};
+#else
+        const int bgr = 0;
+        const float in0mean_ordered[3] = {in0mean[0], in0mean[1], in0mean[2]};
+        const float in1mean_ordered[3] = {in1mean[0], in1mean[1], in1mean[2]};
+#endif
+
+        // exactly what process_cpu feeds
+        ncnn::Mat in0_reorg;
+        ncnn::Mat in1_reorg;
+        cain_preproc_reorg((const unsigned char*)in0image.data, w, h, bgr, in0mean_ordered, w_padded, h_padded, reorg_stride, in0_reorg, net.opt);
+        cain_preproc_reorg((const unsigned char*)in1image.data, w, h, bgr, in1mean_ordered, w_padded, h_padded, reorg_stride, in1_reorg, net.opt);
+
+        free_image(in0image, webp0);
+        free_image(in1image, webp1);
+
+        {
+            ncnn::Extractor ex = net.create_extractor();
+            ex.set_light_mode(true);
+
+            ex.input(in0_reorg_blob, in0_reorg);
+            ex.input(in1_reorg_blob, in1_reorg);
+
+            // in graph order, light mode frees each input once its consumers ran
+            for (size_t k = 0; k < conv_indexes.size(); k++)
+            {
+                ncnn::Mat bottom;
+                ex.extract(layers[conv_indexes[k]]->bottoms[0], bottom);
+
+                stats[k].update(bottom);
+            }
+        }
+
+        fprintf(stderr, "%.2f%%\n", (float)(p + 1) / pairs * 100);
+    }
+
+    // a convolution that never saw a nonzero input stays fp32
+    std::vector<float> thresholds(conv_indexes.size());
+    int calibrated_count = 0;
+    for (size_t k = 0; k < conv_indexes.size(); k++)
+    {
+        thresholds[k] = stats[k].threshold();
+        calibrated_count += thresholds[k] != 0.f ? 1 : 0;
+    }
+
+    FILE* fp = open_file(outputpath, "wb");
+    if (!fp)
+    {
+        fprintf(stderr, "open table for write failed\n");
+        return -1;
+    }
+
+    // per output channel weight scales
+    for (size_t k = 0; k < conv_indexes.size(); k++)
+    {
+        if (thresholds[k] == 0.f)
+            continue;
+
+        const ncnn::Convolution* convolution = (const ncnn::Convolution*)layers[conv_indexes[k]];
+
+        const int num_output = convolution->num_output;
+        const int weight_data_size_output = convolution->weight_data_size / num_output;
+
+        fprintf(fp, "%s_param_0", convolution->name.c_str());
+        for (int q = 0; q < num_output; q++)
+        {
+            const float* ptr = (const float*)convolution->weight_data + weight_data_size_output * q;
+
+            float absmax = 0.f;
+            for (int i = 0; i < weight_data_size_output; i++)
+            {
+                absmax = std::max(absmax, fabsf(ptr[i]));
+            }
+
+            fprintf(fp, " %f", absmax == 0.f ? 1.f : 127.f / absmax);
+        }
+        fprintf(fp, "\n");
+    }
+
+    // per layer input scales
+    for (size_t k = 0; k < conv_indexes.size(); k++)
+    {
+        if (thresholds[k] == 0.f)
+            continue;
+
+        fprintf(fp, "%s %f\n", layers[conv_indexes[k]]->name.c_str(), 127.f / thresholds[k]);
+    }
+
+    fclose(fp);
+
+    fprintf(stderr, "%d of %d convolutions calibrated\n", calibrated_count, (int)conv_indexes.size());
+
+    return 0;
+}
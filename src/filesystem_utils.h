@@ -10,14 +10,22 @@
 #include <windows.h>
 #include "win32dirent.h"
 #else // _WIN32
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <dirent.h>
 #endif // _WIN32
 
 #if __APPLE__
 #include <mach-o/dyld.h>
+#include <copyfile.h>
+#endif
+
+#if __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 #endif
 
 #if _WIN32
@@ -150,6 +158,156 @@ static path_t get_executable_directory()
 }
 #endif
 
+// both paths name the same existing file, through links or different spellings
+#if _WIN32
+static bool path_is_same_file(const path_t& path0, const path_t& path1)
+{
+    HANDLE h0 = CreateFileW(path0.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    if (h0 == INVALID_HANDLE_VALUE)
+        return false;
+
+    HANDLE h1 = CreateFileW(path1.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    if (h1 == INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(h0);
+        return false;
+    }
+
+    BY_HANDLE_FILE_INFORMATION info0;
+    BY_HANDLE_FILE_INFORMATION info1;
+    bool same = GetFileInformationByHandle(h0, &info0) && GetFileInformationByHandle(h1, &info1)
+                && info0.dwVolumeSerialNumber == info1.dwVolumeSerialNumber
+                && info0.nFileIndexHigh == info1.nFileIndexHigh
+                && info0.nFileIndexLow == info1.nFileIndexLow;
+
+    CloseHandle(h0);
+    CloseHandle(h1);
+
+    return same;
+}
+#else
+static bool path_is_same_file(const path_t& path0, const path_t& path1)
+{
+    struct stat s0;
+    struct stat s1;
+    if (stat(path0.c_str(), &s0) != 0 || stat(path1.c_str(), &s1) != 0)
+        return false;
+
+    return s0.st_dev == s1.st_dev && s0.st_ino == s1.st_ino;
+}
+#endif
+
+// copy-on-write clone where the filesystem supports it, plain copy otherwise
+// copying a file onto itself is a no-op, opening the destination would truncate the source
+#if _WIN32
+static int copy_file(const path_t& srcpath, const path_t& dstpath)
+{
+    if (path_is_same_file(srcpath, dstpath))
+        return 0;
+
+    if (!CopyFileW(srcpath.c_str(), dstpath.c_str(), FALSE))
+    {
+        fwprintf(stderr, L"copy %ls to %ls failed\n", srcpath.c_str(), dstpath.c_str());
+        return -1;
+    }
+
+    return 0;
+}
+#elif __APPLE__
+static int copy_file(const path_t& srcpath, const path_t& dstpath)
+{
+    if (path_is_same_file(srcpath, dstpath))
+        return 0;
+
+    // clone refuses an existing destination
+    unlink(dstpath.c_str());
+
+    if (copyfile(srcpath.c_str(), dstpath.c_str(), NULL, COPYFILE_CLONE) != 0)
+    {
+        fprintf(stderr, "copy %s to %s failed\n", srcpath.c_str(), dstpath.c_str());
+        return -1;
+    }
+
+    return 0;
+}
+#else
+static int copy_file(const path_t& srcpath, const path_t& dstpath)
+{
+    if (path_is_same_file(srcpath, dstpath))
+        return 0;
+
+    int src = open(srcpath.c_str(), O_RDONLY);
+    if (src < 0)
+    {
+        fprintf(stderr, "copy %s to %s failed\n", srcpath.c_str(), dstpath.c_str());
+        return -1;
+    }
+
+    int dst = open(dstpath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (dst < 0)
+    {
+        fprintf(stderr, "copy %s to %s failed\n", srcpath.c_str(), dstpath.c_str());
+        close(src);
+        return -1;
+    }
+
+    int ret = 0;
+
+#if __linux__ && defined(FICLONE)
+    if (ioctl(dst, FICLONE, src) == 0)
+    {
+        close(src);
+        close(dst);
+        return 0;
+    }
+#endif
+
+    char buffer[65536];
+    while (ret == 0)
+    {
+        ssize_t n = read(src, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n == 0)
+            break;
+
+        if (n < 0)
+        {
+            ret = -1;
+            break;
+        }
+
+        // write may be interrupted or come back short
+        ssize_t nwrite = 0;
+        while (nwrite < n)
+        {
+            ssize_t m = write(dst, buffer + nwrite, n - nwrite);
+            if (m < 0 && errno == EINTR)
+                continue;
+
+            if (m <= 0)
+            {
+                ret = -1;
+                break;
+            }
+
+            nwrite += m;
+        }
+    }
+
+    if (ret != 0)
+    {
+        fprintf(stderr, "copy %s to %s failed\n", srcpath.c_str(), dstpath.c_str());
+    }
+
+    close(src);
+    close(dst);
+
+    return ret;
+}
+#endif
+
 static bool filepath_is_readable(const path_t& path)
 {
 #if _WIN32
@@ -2,7 +2,8 @@
 
 #include <stdio.h>
 #include <algorithm>
-#include <queue>
+#include <atomic>
+#include <map>
 #include <vector>
 #include <clocale>
 
@@ -96,9 +97,38 @@ static std::vector<int> parse_optarg_int_array(const char* optarg)
 #include "benchmark.h"
 
 #include "cain.h"
+#include "cain_cpu.h"
 
 #include "filesystem_utils.h"
 
+#if _WIN32
+static int parse_precision(const wchar_t* optarg)
+{
+    if (wcscmp(optarg, L"fp32") == 0)
+        return CAIN_PRECISION_FP32;
+    if (wcscmp(optarg, L"fp16") == 0)
+        return CAIN_PRECISION_FP16;
+    if (wcscmp(optarg, L"bf16") == 0)
+        return CAIN_PRECISION_BF16;
+    if (wcscmp(optarg, L"auto") == 0)
+        return CAIN_PRECISION_AUTO;
+    return -1;
+}
+#else
+static int parse_precision(const char* optarg)
+{
+    if (strcmp(optarg, "fp32") == 0)
+        return CAIN_PRECISION_FP32;
+    if (strcmp(optarg, "fp16") == 0)
+        return CAIN_PRECISION_FP16;
+    if (strcmp(optarg, "bf16") == 0)
+        return CAIN_PRECISION_BF16;
+    if (strcmp(optarg, "auto") == 0)
+        return CAIN_PRECISION_AUTO;
+    return -1;
+}
+#endif
+
 static void print_usage()
 {
     fprintf(stderr, "Usage: cain-ncnn-vulkan -0 infile -1 infile1 -o outfile [options]...\n");
@@ -109,13 +139,20 @@ static void print_usage()
     fprintf(stderr, "  -1 input1-path       input image1 path (jpg/png/webp)\n");
     fprintf(stderr, "  -i input-path        input image directory (jpg/png/webp)\n");
     fprintf(stderr, "  -o output-path       output image path (jpg/png/webp) or directory\n");
+    fprintf(stderr, "  -n frame-count-scale output frames per input frame in directory mode (2/4/8/16, default=2)\n");
     fprintf(stderr, "  -m model-path        cain model path (default=cain)\n");
-    fprintf(stderr, "  -g gpu-id            gpu device to use (default=auto) can be 0,1,2 for multi-gpu\n");
+    fprintf(stderr, "  -c cache-path        directory to keep compiled shaders across runs (default=none)\n");
+    fprintf(stderr, "  -t tile-size         tile size (>=32/0=whole frame, default=0) can be 0,0,0 for multi-gpu\n");
+    fprintf(stderr, "  -g gpu-id            gpu device to use (-1=cpu, default=auto) can be 0,1,2 for multi-gpu\n");
+    fprintf(stderr, "  -a                   autotune cpu convolution for the input frame size, remembered in cache-path\n");
+    fprintf(stderr, "  -p precision         cpu feature map precision (fp32/fp16/bf16/auto, default=fp32)\n");
+    fprintf(stderr, "  -q quantize          int8 runs cpu convolutions with the calibrated cain-int8 model (default=none)\n");
+    fprintf(stderr, "  -d queue-depth       tasks buffered between load/proc/save (default=8)\n");
     fprintf(stderr, "  -j load:proc:save    thread count for load/proc/save (default=1:2:2) can be 1:2,2,2:2 for multi-gpu\n");
     fprintf(stderr, "  -f pattern-format    output image filename pattern format (%%08d.jpg/png/webp, default=ext/%%08d.png)\n");
 }
 
-static int decode_image(const path_t& imagepath, ncnn::Mat& image, int* webp)
+static int decode_image(const path_t& imagepath, ncnn::Mat& image, int* webp, float mean_rgb[3])
 {
     *webp = 0;
 
@@ -181,6 +218,9 @@ static int decode_image(const path_t& imagepath, ncnn::Mat& image, int* webp)
 
     image = ncnn::Mat(w, h, (void*)pixeldata, (size_t)3, 3);
 
+    // while the pixels are still warm in cache
+    cain_image_mean(pixeldata, w, h, mean_rgb);
+
     return 0;
 }
 
@@ -235,97 +275,1112 @@ public:
     path_t outpath;
     float timestep;
 
-    ncnn::Mat in0image;
-    ncnn::Mat in1image;
-    ncnn::Mat outimage;
-};
+    ncnn::Mat in0image;
+    ncnn::Mat in1image;
+    ncnn::Mat outimage;
+
+    float in0mean[3];
+    float in1mean[3];
+
+    // input frame id, -1 if the frame is not shared with another task
+    int in0id;
+    int in1id;
+
+    // frame id of the output if the next level reads it, -1 otherwise
+    int outid;
+    float outmean[3];
+
+    // execution plan bucket of the frame size
+    unsigned long long bucket;
+
+    // timestep 0 and 1 output the source frame in0 as is, without the network
+    // PASSTHROUGH_COPY copies the file, PASSTHROUGH_TRANSCODE decodes and encodes it to the output format
+    int passthrough;
+};
+
+#define PASSTHROUGH_NONE 0
+#define PASSTHROUGH_COPY 1
+#define PASSTHROUGH_TRANSCODE 2
+
+// jpg and jpeg are the same format
+static bool same_image_format(const path_t& path0, const path_t& path1)
+{
+    path_t ext0 = get_file_extension(path0);
+    path_t ext1 = get_file_extension(path1);
+    for (size_t i=0; i<ext0.size(); i++)
+    {
+        if (ext0[i] >= PATHSTR('A') && ext0[i] <= PATHSTR('Z'))
+            ext0[i] += PATHSTR('a') - PATHSTR('A');
+    }
+    for (size_t i=0; i<ext1.size(); i++)
+    {
+        if (ext1[i] >= PATHSTR('A') && ext1[i] <= PATHSTR('Z'))
+            ext1[i] += PATHSTR('a') - PATHSTR('A');
+    }
+
+    if (ext0 == PATHSTR("jpeg"))
+        ext0 = PATHSTR("jpg");
+    if (ext1 == PATHSTR("jpeg"))
+        ext1 = PATHSTR("jpg");
+
+    return ext0 == ext1;
+}
+
+// every task of the session, generated on demand from its index
+// nothing here grows with the sequence length but the directory listing itself
+class TaskList
+{
+public:
+    TaskList()
+    {
+        count = 0;
+        numframe = 0;
+        scale = 2;
+    }
+
+    // one pair of files
+    void init(const path_t& _input0path, const path_t& _input1path, const path_t& _outputpath)
+    {
+        input0path = _input0path;
+        input1path = _input1path;
+        outputpath = _outputpath;
+
+        count = 0;
+        numframe = 1;
+        scale = 2;
+    }
+
+    // a directory of frames into a directory of scale times as many, scale is a power of two
+    void init(const path_t& _inputpath, const std::vector<path_t>& _filenames, const path_t& _outputpath, const path_t& _pattern, const path_t& _format, int _scale)
+    {
+        inputpath = _inputpath;
+        filenames = _filenames;
+        outputpath = _outputpath;
+        pattern = _pattern;
+        format = _format;
+
+        count = filenames.size();
+        scale = _scale;
+        numframe = count * scale;
+    }
+
+    int size() const
+    {
+        return numframe;
+    }
+
+    // tasks that run the network
+    int network_size() const
+    {
+        if (count == 0)
+            return numframe;
+
+        return count < 2 ? 0 : (count - 1) * (scale - 1);
+    }
+
+    // frame ids count output frames, source frame sx has id sx * scale
+    // a task of the first level reads two source frames, a deeper one reads frames of the levels above it
+    void get(int i, Task& v) const
+    {
+        v.id = i;
+
+        if (count == 0)
+        {
+            v.in0path = input0path;
+            v.in1path = input1path;
+            v.outpath = outputpath;
+            v.timestep = 0.5f;
+            v.in0id = -1;
+            v.in1id = -1;
+            v.outid = -1;
+            v.passthrough = PASSTHROUGH_NONE;
+            return;
+        }
+
+        int p0;
+        int p1;
+        v.passthrough = plan(i, &p0, &p1);
+
+        v.outpath = output_path(i);
+        v.outid = -1;
+
+        if (v.passthrough != PASSTHROUGH_NONE)
+        {
+            // the source frame goes to in0 alone, in1 is never decoded
+            v.in0path = frame_path(p0);
+            v.in1path = v.in0path;
+            v.timestep = 0.f;
+            v.in0id = p0;
+            v.in1id = -1;
+            return;
+        }
+
+        // the network always synthesizes the midpoint of its two inputs
+        v.in0path = frame_path(p0);
+        v.in1path = frame_path(p1);
+        v.timestep = 0.5f;
+        v.in0id = p0;
+        v.in1id = p1;
+
+        // read by the deeper levels
+        if ((i % scale & -(i % scale)) > 1)
+            v.outid = i;
+    }
+
+    // true when task i reads source frames only
+    bool is_first_level(int i) const
+    {
+        if (count == 0)
+            return true;
+
+        int p0;
+        int p1;
+        return plan(i, &p0, &p1) == PASSTHROUGH_NONE && p0 % scale == 0 && p1 % scale == 0;
+    }
+
+    // the network tasks reading generated frame id, every deeper level reads it from either side
+    int readers(int id, std::vector<int>& tasks) const
+    {
+        tasks.clear();
+
+        const int r = id % scale;
+        if (count == 0 || id < 0 || r == 0)
+            return 0;
+
+        const int step = r & -r;
+        for (int d = step / 2; d > 0; d /= 2)
+        {
+            tasks.push_back(id - d);
+            tasks.push_back(id + d);
+        }
+
+        return (int)tasks.size();
+    }
+
+    // the frame task i reads besides frame id
+    int other_parent(int i, int id) const
+    {
+        int p0;
+        int p1;
+        plan(i, &p0, &p1);
+        return p0 == id ? p1 : p0;
+    }
+
+    bool is_source_frame(int id) const
+    {
+        return id % scale == 0;
+    }
+
+    // tasks reading frame id, with network_only just those that run the network
+    // otherwise those that decode it, the network ones and the transcoded passthrough ones
+    int uses(int id, int network_only) const
+    {
+        if (count == 0 || id < 0)
+            return 0;
+
+        // a task reads frames at most one source interval away from its own index
+        const int i0 = std::max(id - scale, 0);
+        const int i1 = std::min(id + scale, numframe - 1);
+
+        int n = 0;
+        for (int i=i0; i<=i1; i++)
+        {
+            int p0;
+            int p1;
+            int passthrough = plan(i, &p0, &p1);
+
+            // timestep 0 and 1 never reach the network
+            if (passthrough != PASSTHROUGH_NONE)
+            {
+                if (!network_only && passthrough == PASSTHROUGH_TRANSCODE && p0 == id)
+                    n++;
+
+                continue;
+            }
+
+            if (p0 == id)
+                n++;
+            if (p1 == id)
+                n++;
+        }
+
+        return n;
+    }
+
+private:
+    // a network task reads frames p0 and p1, the recursive midpoint parents of frame i
+    // a passthrough task reads source frame p0 alone
+    int plan(int i, int* p0, int* p1) const
+    {
+        const int sx = i / scale;
+        const int r = i % scale;
+
+        *p1 = -1;
+
+        // the tail past the last source frame repeats it
+        if (sx >= count - 1)
+        {
+            *p0 = (count - 1) * scale;
+            return passthrough(count - 1);
+        }
+
+        if (r == 0)
+        {
+            *p0 = i;
+            return passthrough(sx);
+        }
+
+        const int step = r & -r;
+        *p0 = i - step;
+        *p1 = i + step;
+        return PASSTHROUGH_NONE;
+    }
+
+    int passthrough(int sx) const
+    {
+        return same_image_format(filenames[sx], format) ? PASSTHROUGH_COPY : PASSTHROUGH_TRANSCODE;
+    }
+
+    // source frames are read from the input directory, generated ones are named after their output
+    path_t frame_path(int id) const
+    {
+        if (id % scale == 0)
+            return inputpath + PATHSTR('/') + filenames[id / scale];
+
+        return output_path(id);
+    }
+
+    path_t output_path(int i) const
+    {
+#if _WIN32
+        wchar_t tmp[256];
+        swprintf(tmp, pattern.c_str(), i+1);
+#else
+        char tmp[256];
+        sprintf(tmp, pattern.c_str(), i+1); // ffmpeg start from 1
+#endif
+        path_t output_filename = path_t(tmp) + PATHSTR('.') + format;
+
+        return outputpath + PATHSTR('/') + output_filename;
+    }
+
+private:
+    path_t input0path;
+    path_t input1path;
+
+    path_t inputpath;
+    std::vector<path_t> filenames;
+    path_t outputpath;
+    path_t pattern;
+    path_t format;
+
+    int count;
+    int numframe;
+    int scale;
+};
+
+class TaskQueueWakeup
+{
+public:
+    TaskQueueWakeup()
+    {
+        waiters = 0;
+    }
+
+    void notify()
+    {
+        // pairs with the fence in TaskQueue::put/get, either the waiter sees the ring move or we see the waiter
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters.load(std::memory_order_relaxed) == 0)
+            return;
+
+        lock.lock();
+        condition.signal();
+        lock.unlock();
+    }
+
+public:
+    std::atomic<int> waiters;
+    ncnn::Mutex lock;
+    ncnn::ConditionVariable condition;
+};
+
+// bounded multi-producer multi-consumer ring of task handles
+// a handle belongs to whoever holds it, put hands it over to the thread that gets it
+class TaskQueue
+{
+public:
+    TaskQueue()
+    {
+        cells = 0;
+        size = 0;
+        init(8);
+    }
+
+    ~TaskQueue()
+    {
+        delete[] cells;
+    }
+
+    // call before any thread uses the queue
+    void init(int depth)
+    {
+        // one slot could not tell full from empty by its sequence
+        size = std::max(depth, 2);
+
+        delete[] cells;
+        cells = new Cell[size];
+        for (size_t i = 0; i < size; i++)
+        {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+            cells[i].task = 0;
+        }
+
+        enqueue_pos.store(0, std::memory_order_relaxed);
+        dequeue_pos.store(0, std::memory_order_relaxed);
+    }
+
+    void put(Task* v)
+    {
+        if (!enqueue(v))
+        {
+            not_full.lock.lock();
+            not_full.waiters++;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+
+            while (!enqueue(v))
+            {
+                not_full.condition.wait(not_full.lock);
+            }
+
+            not_full.waiters--;
+            not_full.lock.unlock();
+        }
+
+        not_empty.notify();
+    }
+
+    Task* get()
+    {
+        Task* v = try_get();
+        if (!v)
+        {
+            not_empty.lock.lock();
+            not_empty.waiters++;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+
+            while (!(v = try_get()))
+            {
+                not_empty.condition.wait(not_empty.lock);
+            }
+
+            not_empty.waiters--;
+            not_empty.lock.unlock();
+        }
+
+        not_full.notify();
+
+        return v;
+    }
+
+    // returns 0 when the ring is empty
+    Task* try_get()
+    {
+        size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+        Cell* cell;
+        for (;;)
+        {
+            cell = &cells[pos % size];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            ptrdiff_t dif = (ptrdiff_t)seq - (ptrdiff_t)(pos + 1);
+            if (dif == 0)
+            {
+                if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (dif < 0)
+            {
+                return 0;
+            }
+            else
+            {
+                pos = dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+
+        Task* v = cell->task;
+        cell->task = 0;
+        cell->sequence.store(pos + size, std::memory_order_release);
+
+        return v;
+    }
+
+    // returns false when the ring is full, the caller keeps v
+    bool try_put(Task* v)
+    {
+        if (!enqueue(v))
+            return false;
+
+        not_empty.notify();
+
+        return true;
+    }
+
+private:
+    bool enqueue(Task* v)
+    {
+        size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        Cell* cell;
+        for (;;)
+        {
+            cell = &cells[pos % size];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            ptrdiff_t dif = (ptrdiff_t)seq - (ptrdiff_t)pos;
+            if (dif == 0)
+            {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (dif < 0)
+            {
+                return false;
+            }
+            else
+            {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+
+        cell->task = v;
+        cell->sequence.store(pos + 1, std::memory_order_release);
+
+        return true;
+    }
+
+private:
+    class Cell
+    {
+    public:
+        std::atomic<size_t> sequence;
+        Task* task;
+    };
+
+    Cell* cells;
+    size_t size;
+
+    // producers and consumers touch different cache lines
+    char pad0[64];
+    std::atomic<size_t> enqueue_pos;
+    char pad1[64];
+    std::atomic<size_t> dequeue_pos;
+    char pad2[64];
+
+    TaskQueueWakeup not_full;
+    TaskQueueWakeup not_empty;
+};
+
+TaskQueue toproc;
+TaskQueue tosave;
+
+class FrameUseCount
+{
+public:
+    void init(const TaskList* _tasks)
+    {
+        tasks = _tasks;
+        counts.clear();
+    }
+
+    // returns true when the last task using frame id is done
+    bool release(int id)
+    {
+        if (id < 0)
+            return false;
+
+        lock.lock();
+
+        // counted when first needed, only the frames in flight have an entry
+        std::map<int, int>::iterator it = counts.find(id);
+        if (it == counts.end())
+        {
+            it = counts.insert(std::make_pair(id, tasks->uses(id, 1))).first;
+        }
+
+        bool last = --it->second <= 0;
+        if (last)
+            counts.erase(it);
+
+        lock.unlock();
+
+        return last;
+    }
+
+private:
+    const TaskList* tasks;
+
+    ncnn::Mutex lock;
+    std::map<int, int> counts;
+};
+
+FrameUseCount frame_uses;
+
+static void free_pixels(unsigned char* pixeldata, int webp)
+{
+    if (webp == 1)
+    {
+        free(pixeldata);
+    }
+    else
+    {
+#if _WIN32
+        free(pixeldata);
+#else
+        stbi_image_free(pixeldata);
+#endif
+    }
+}
+
+// decoded source frames shared by every task reading them
+// a frame is decoded once and its pixels are freed when the last task using it has been saved
+class DecodedFrameCache
+{
+public:
+    void init(const TaskList* _tasks)
+    {
+        tasks = _tasks;
+        frames.clear();
+    }
+
+    // the first caller decodes, concurrent callers for the same frame wait for it
+    // a frame without id is not shared and decoded for the caller alone
+    int acquire(int id, const path_t& path, ncnn::Mat& image, int* webp, float mean_rgb[3])
+    {
+        if (id < 0)
+            return decode_image(path, image, webp, mean_rgb);
+
+        lock.lock();
+
+        std::map<int, Frame>::iterator it = frames.find(id);
+        if (it == frames.end())
+        {
+            it = frames.insert(std::make_pair(id, Frame())).first;
+            it->second.uses = tasks->uses(id, 0);
+        }
+
+        // std::map nodes stay put while the lock is dropped
+        Frame& frame = it->second;
+
+        if (frame.state == FRAME_EMPTY)
+        {
+            frame.state = FRAME_DECODING;
+
+            lock.unlock();
+
+            ncnn::Mat decoded;
+            int decoded_webp = 0;
+            float decoded_mean[3] = {0.f, 0.f, 0.f};
+            int ret = decode_image(path, decoded, &decoded_webp, decoded_mean);
+
+            lock.lock();
+
+            frame.image = decoded;
+            frame.webp = decoded_webp;
+            frame.mean_rgb[0] = decoded_mean[0];
+            frame.mean_rgb[1] = decoded_mean[1];
+            frame.mean_rgb[2] = decoded_mean[2];
+            frame.state = ret == 0 ? FRAME_READY : FRAME_FAILED;
+
+            condition.broadcast();
+        }
+
+        while (frame.state == FRAME_DECODING)
+        {
+            condition.wait(lock);
+        }
+
+        int ret = frame.state == FRAME_READY ? 0 : -1;
+
+        image = frame.image;
+        *webp = frame.webp;
+        mean_rgb[0] = frame.mean_rgb[0];
+        mean_rgb[1] = frame.mean_rgb[1];
+        mean_rgb[2] = frame.mean_rgb[2];
+
+        lock.unlock();
+
+        return ret;
+    }
+
+    void release(int id, const ncnn::Mat& image, int webp)
+    {
+        if (id < 0)
+        {
+            if (image.data)
+            {
+                free_pixels((unsigned char*)image.data, webp);
+            }
+            return;
+        }
+
+        lock.lock();
+
+        std::map<int, Frame>::iterator it = frames.find(id);
+        if (it != frames.end() && --it->second.uses <= 0)
+        {
+            if (it->second.state == FRAME_READY)
+            {
+                free_pixels((unsigned char*)it->second.image.data, it->second.webp);
+            }
+
+            frames.erase(it);
+        }
+
+        lock.unlock();
+    }
+
+private:
+    enum
+    {
+        FRAME_EMPTY = 0,
+        FRAME_DECODING = 1,
+        FRAME_READY = 2,
+        FRAME_FAILED = 3
+    };
+
+    class Frame
+    {
+    public:
+        Frame()
+        {
+            uses = 0;
+            state = FRAME_EMPTY;
+            webp = 0;
+            mean_rgb[0] = 0.f;
+            mean_rgb[1] = 0.f;
+            mean_rgb[2] = 0.f;
+        }
+
+        int uses;
+        int state;
+
+        // wraps the decoder output, not refcounted
+        ncnn::Mat image;
+        int webp;
+        float mean_rgb[3];
+    };
+
+    const TaskList* tasks;
+
+    ncnn::Mutex lock;
+    ncnn::ConditionVariable condition;
+    std::map<int, Frame> frames;
+};
+
+DecodedFrameCache decoded_frames;
+
+class LoadThreadParams
+{
+public:
+    int jobs_load;
+
+    // for the bucket of each task, and every instance may hold cached frames
+    std::vector<CAIN*> cains;
+
+    // session data
+    const TaskList* tasks;
+};
+
+// output images of finished tasks are recycled, the number in flight is bounded by the queues
+ncnn::PoolAllocator outimage_allocator;
+
+// schedules the network tasks of the deeper levels, a task is ready once the generated frames it reads are done
+// generated frames stay in memory until every task reading them is built, no encode/decode round trip
+class FrameGraph
+{
+public:
+    FrameGraph()
+    {
+        tasks = 0;
+        pending = 0;
+        nready = 0;
+    }
+
+    void init(const TaskList* _tasks, const std::vector<CAIN*>& _cains)
+    {
+        tasks = _tasks;
+        cains = _cains;
+        frames.clear();
+        ready.clear();
+        pending = tasks->network_size();
+        nready = 0;
+    }
+
+    // a network task is done, ret != 0 drops every task depending on its output
+    void finish(const Task& v, int ret)
+    {
+        std::vector<Build> builds;
+        std::vector<int> drops;
+
+        lock.lock();
+
+        if (v.outid >= 0)
+        {
+            std::vector<int> c;
+            Frame& frame = frames[v.outid];
+            frame.state = ret == 0 ? FRAME_READY : FRAME_FAILED;
+            frame.consumers = tasks->readers(v.outid, c);
+            frame.image = v.outimage;
+            frame.mean_rgb[0] = v.outmean[0];
+            frame.mean_rgb[1] = v.outmean[1];
+            frame.mean_rgb[2] = v.outmean[2];
+
+            resolve_readers(v.outid, builds, drops);
+        }
+
+        pending--;
+
+        if (pending == 0)
+        {
+            // wakes the main thread waiting for the last task
+            condition.signal();
+        }
+
+        lock.unlock();
+
+        for (size_t i=0; i<drops.size(); i++)
+        {
+            drop(drops[i]);
+        }
+
+        for (size_t i=0; i<builds.size(); i++)
+        {
+            build(builds[i], v.bucket);
+        }
+    }
+
+    // returns 0 when no built task is waiting
+    Task* try_get_ready()
+    {
+        if (nready.load(std::memory_order_relaxed) == 0)
+            return 0;
+
+        Task* v = 0;
+
+        lock.lock();
+        if (!ready.empty())
+        {
+            v = ready.back();
+            ready.pop_back();
+            nready--;
+        }
+        lock.unlock();
+
+        return v;
+    }
+
+    // until every network task is done, nothing reaches toproc afterwards
+    void wait()
+    {
+        lock.lock();
+        while (pending > 0)
+        {
+            condition.wait(lock);
+        }
+        lock.unlock();
+    }
+
+private:
+    enum
+    {
+        FRAME_PENDING = 0,
+        FRAME_READY = 1,
+        FRAME_FAILED = 2
+    };
+
+    class Frame
+    {
+    public:
+        Frame()
+        {
+            state = FRAME_PENDING;
+            consumers = 0;
+        }
+
+        int state;
+        int consumers;
+        ncnn::Mat image;
+        float mean_rgb[3];
+    };
 
-class TaskQueue
-{
-public:
-    TaskQueue()
+    // a task to build with the generated frames it reads, taken out of the graph
+    class Build
+    {
+    public:
+        int i;
+        int id[2];
+        ncnn::Mat image[2];
+        float mean_rgb[2][3];
+    };
+
+    int state(int id) const
     {
+        if (tasks->is_source_frame(id))
+            return FRAME_READY;
+
+        std::map<int, Frame>::const_iterator it = frames.find(id);
+        return it == frames.end() ? FRAME_PENDING : it->second.state;
     }
 
-    void put(const Task& v)
+    // the child is settled, the generated frame loses a reader
+    void consume(int id, Build* b, int k)
     {
-        lock.lock();
+        if (tasks->is_source_frame(id))
+            return;
 
-        while (tasks.size() >= 8) // FIXME hardcode queue length
+        std::map<int, Frame>::iterator it = frames.find(id);
+        if (it == frames.end())
+            return;
+
+        if (b)
         {
-            condition.wait(lock);
+            b->image[k] = it->second.image;
+            b->mean_rgb[k][0] = it->second.mean_rgb[0];
+            b->mean_rgb[k][1] = it->second.mean_rgb[1];
+            b->mean_rgb[k][2] = it->second.mean_rgb[2];
         }
 
-        tasks.push(v);
+        if (--it->second.consumers <= 0)
+            frames.erase(it);
+    }
 
-        lock.unlock();
+    // lock held, frame id just settled, the second parent to settle decides each reader
+    void resolve_readers(int id, std::vector<Build>& builds, std::vector<int>& drops)
+    {
+        std::vector<int> c;
+        tasks->readers(id, c);
 
-        condition.signal();
+        for (size_t k=0; k<c.size(); k++)
+        {
+            int o = tasks->other_parent(c[k], id);
+            int ostate = state(o);
+            if (ostate == FRAME_PENDING)
+                continue;
+
+            if (state(id) == FRAME_READY && ostate == FRAME_READY)
+            {
+                Task v;
+                tasks->get(c[k], v);
+
+                Build b;
+                b.i = c[k];
+                b.id[0] = v.in0id;
+                b.id[1] = v.in1id;
+                consume(v.in0id, &b, 0);
+                consume(v.in1id, &b, 1);
+                builds.push_back(b);
+            }
+            else
+            {
+                consume(id, 0, 0);
+                consume(o, 0, 0);
+
+                // the child never runs, and neither does anything reading its output
+                std::vector<int> cc;
+                if (tasks->readers(c[k], cc))
+                {
+                    frames[c[k]].state = FRAME_FAILED;
+                    frames[c[k]].consumers = (int)cc.size();
+                }
+                drops.push_back(c[k]);
+                pending--;
+
+                resolve_readers(c[k], builds, drops);
+            }
+        }
     }
 
-    void get(Task& v)
+    // give back the frame uses counted for a task that never runs
+    void drop(int i)
     {
-        lock.lock();
+        Task v;
+        tasks->get(i, v);
 
-        while (tasks.size() == 0)
+        const int ids[2] = { v.in0id, v.in1id };
+        for (int k=0; k<2; k++)
         {
-            condition.wait(lock);
+            if (tasks->is_source_frame(ids[k]))
+                decoded_frames.release(ids[k], ncnn::Mat(), 0);
+
+            if (frame_uses.release(ids[k]))
+            {
+                for (size_t j=0; j<cains.size(); j++)
+                    cains[j]->release_frame(ids[k]);
+            }
         }
+    }
 
-        v = tasks.front();
-        tasks.pop();
+    void build(const Build& b, unsigned long long bucket)
+    {
+        Task* t = new Task;
+        Task& v = *t;
+        tasks->get(b.i, v);
+        v.bucket = bucket;
+        v.webp0 = 0;
+        v.webp1 = 0;
+
+        // the source frame of a mixed pair comes from the decoded frame cache
+        int ret0 = 0;
+        int ret1 = 0;
+        if (tasks->is_source_frame(b.id[0]))
+        {
+            ret0 = decoded_frames.acquire(v.in0id, v.in0path, v.in0image, &v.webp0, v.in0mean);
+        }
+        else
+        {
+            v.in0image = b.image[0];
+            v.in0mean[0] = b.mean_rgb[0][0];
+            v.in0mean[1] = b.mean_rgb[0][1];
+            v.in0mean[2] = b.mean_rgb[0][2];
+        }
 
-        lock.unlock();
+        if (tasks->is_source_frame(b.id[1]))
+        {
+            ret1 = decoded_frames.acquire(v.in1id, v.in1path, v.in1image, &v.webp1, v.in1mean);
+        }
+        else
+        {
+            v.in1image = b.image[1];
+            v.in1mean[0] = b.mean_rgb[1][0];
+            v.in1mean[1] = b.mean_rgb[1][1];
+            v.in1mean[2] = b.mean_rgb[1][2];
+        }
 
-        condition.signal();
+        if (ret0 != 0 || ret1 != 0)
+        {
+            if (tasks->is_source_frame(b.id[0]))
+                decoded_frames.release(v.in0id, v.in0image, v.webp0);
+            if (tasks->is_source_frame(b.id[1]))
+                decoded_frames.release(v.in1id, v.in1image, v.webp1);
+
+            const int ids[2] = { v.in0id, v.in1id };
+            for (int k=0; k<2; k++)
+            {
+                if (frame_uses.release(ids[k]))
+                {
+                    for (size_t j=0; j<cains.size(); j++)
+                        cains[j]->release_frame(ids[k]);
+                }
+            }
+
+            finish(v, -1);
+            delete t;
+            return;
+        }
+
+        v.outimage = ncnn::Mat(v.in0image.w, v.in0image.h, (size_t)3, 3, &outimage_allocator);
+
+        // any proc thread may take it, the ring is only full while they all have work
+        if (toproc.try_put(t))
+            return;
+
+        lock.lock();
+        ready.push_back(t);
+        nready++;
+        lock.unlock();
     }
 
 private:
+    const TaskList* tasks;
+    std::vector<CAIN*> cains;
+
     ncnn::Mutex lock;
     ncnn::ConditionVariable condition;
-    std::queue<Task> tasks;
+    std::map<int, Frame> frames;
+    std::vector<Task*> ready;
+    std::atomic<int> nready;
+    int pending;
 };
 
-TaskQueue toproc;
-TaskQueue tosave;
-
-class LoadThreadParams
-{
-public:
-    int jobs_load;
-
-    // session data
-    std::vector<path_t> input0_files;
-    std::vector<path_t> input1_files;
-    std::vector<path_t> output_files;
-    std::vector<float> timesteps;
-};
+FrameGraph graph;
 
 void* load(void* args)
 {
     const LoadThreadParams* ltp = (const LoadThreadParams*)args;
-    const int count = ltp->output_files.size();
+    const int count = ltp->tasks->size();
 
-    #pragma omp parallel for schedule(static,1) num_threads(ltp->jobs_load)
+    // tasks are handed out in sequence order and the bounded proc queue holds the loaders back,
+    // so only a fixed window of frames around the current position is ever decoded
+    #pragma omp parallel for schedule(dynamic,1) num_threads(ltp->jobs_load)
     for (int i=0; i<count; i++)
     {
-        const path_t& image0path = ltp->input0_files[i];
-        const path_t& image1path = ltp->input1_files[i];
+        Task* t = new Task;
+        Task& v = *t;
+        ltp->tasks->get(i, v);
+        v.bucket = 0;
 
-        Task v;
-        v.id = i;
-        v.in0path = image0path;
-        v.in1path = image1path;
-        v.outpath = ltp->output_files[i];
-        v.timestep = ltp->timesteps[i];
+        if (v.passthrough == PASSTHROUGH_COPY)
+        {
+            // nothing to decode, the save thread copies the file
+            tosave.put(t);
+            continue;
+        }
+
+        if (v.passthrough == PASSTHROUGH_TRANSCODE)
+        {
+            int ret = decoded_frames.acquire(v.in0id, v.in0path, v.in0image, &v.webp0, v.in0mean);
+            if (ret == 0)
+            {
+                v.outimage = v.in0image;
+                tosave.put(t);
+            }
+            else
+            {
+                decoded_frames.release(v.in0id, v.in0image, v.webp0);
+                delete t;
+            }
+            continue;
+        }
+
+        if (!ltp->tasks->is_first_level(i))
+        {
+            // built by the frame graph once the level above is done
+            delete t;
+            continue;
+        }
 
-        int ret0 = decode_image(image0path, v.in0image, &v.webp0);
-        int ret1 = decode_image(image1path, v.in1image, &v.webp1);
+        int ret0 = decoded_frames.acquire(v.in0id, v.in0path, v.in0image, &v.webp0, v.in0mean);
+        int ret1 = decoded_frames.acquire(v.in1id, v.in1path, v.in1image, &v.webp1, v.in1mean);
 
-        if (ret0 != 0 || ret1 != 1)
+        if (ret0 == 0 && ret1 == 0)
+        {
+            v.outimage = ncnn::Mat(v.in0image.w, v.in0image.h, (size_t)3, 3, &outimage_allocator);
+            v.bucket = ltp->cains[0]->bucket(v.in0image.w, v.in0image.h);
+            toproc.put(t);
+        }
+        else
         {
-            v.outimage = ncnn::Mat(v.in0image.w, v.in0image.h, (size_t)3, 3);
-            toproc.put(v);
+            // the task is dropped, give back what it holds
+            decoded_frames.release(v.in0id, v.in0image, v.webp0);
+            decoded_frames.release(v.in1id, v.in1image, v.webp1);
+
+            if (v.timestep != 0.f && v.timestep != 1.f)
+            {
+                if (frame_uses.release(v.in0id))
+                {
+                    for (size_t j=0; j<ltp->cains.size(); j++)
+                        ltp->cains[j]->release_frame(v.in0id);
+                }
+
+                if (frame_uses.release(v.in1id))
+                {
+                    for (size_t j=0; j<ltp->cains.size(); j++)
+                        ltp->cains[j]->release_frame(v.in1id);
+                }
+            }
+
+            graph.finish(v, -1);
+
+            delete t;
         }
     }
 
@@ -336,6 +1391,9 @@ class ProcThreadParams
 {
 public:
     const CAIN* cain;
+
+    // every instance may hold cached frames
+    std::vector<CAIN*> cains;
 };
 
 void* proc(void* args)
@@ -343,18 +1401,77 @@ void* proc(void* args)
     const ProcThreadParams* ptp = (const ProcThreadParams*)args;
     const CAIN* cain = ptp->cain;
 
+    unsigned long long bucket = 0;
+    Task* held = 0;
+
     for (;;)
     {
-        Task v;
+        Task* t = held;
+        held = 0;
+
+        if (!t)
+        {
+            // tasks of the deeper levels first, they free the generated frames they read
+            t = graph.try_get_ready();
+        }
 
-        toproc.get(v);
+        if (!t)
+        {
+            t = toproc.get();
+
+            // a task of another bucket trades places with the next queued one once if that one is ours,
+            // so the execution plan stays hot and nothing is held back for more than a task
+            if (t->id != -233 && t->bucket != bucket)
+            {
+                Task* next = toproc.try_get();
+                if (next && next->id != -233 && next->bucket == bucket)
+                {
+                    held = t;
+                    t = next;
+                }
+                else
+                {
+                    held = next;
+                }
+            }
+        }
 
-        if (v.id == -233)
+        if (t->id == -233)
+        {
+            delete t;
             break;
+        }
+
+        Task& v = *t;
+
+        bucket = v.bucket;
+
+        int ret = cain->process(v.in0image, v.in1image, v.in0mean, v.in1mean, v.in0id, v.in1id, v.timestep, v.outimage);
+
+        if (ret == 0 && v.outid >= 0)
+        {
+            // the next level reads it like a decoded frame
+            cain_image_mean((const unsigned char*)v.outimage.data, v.outimage.w, v.outimage.h, v.outmean);
+        }
+
+        if (v.timestep != 0.f && v.timestep != 1.f)
+        {
+            if (frame_uses.release(v.in0id))
+            {
+                for (size_t i=0; i<ptp->cains.size(); i++)
+                    ptp->cains[i]->release_frame(v.in0id);
+            }
+
+            if (frame_uses.release(v.in1id))
+            {
+                for (size_t i=0; i<ptp->cains.size(); i++)
+                    ptp->cains[i]->release_frame(v.in1id);
+            }
+        }
 
-        cain->process(v.in0image, v.in1image, v.timestep, v.outimage);
+        graph.finish(v, ret);
 
-        tosave.put(v);
+        tosave.put(t);
     }
 
     return 0;
@@ -373,46 +1490,21 @@ void* save(void* args)
 
     for (;;)
     {
-        Task v;
+        Task* t = tosave.get();
 
-        tosave.get(v);
-
-        if (v.id == -233)
+        if (t->id == -233)
+        {
+            delete t;
             break;
+        }
 
-        int ret = encode_image(v.outpath, v.outimage);
+        Task& v = *t;
 
-        // free input pixel data
-        {
-            unsigned char* pixeldata = (unsigned char*)v.in0image.data;
-            if (v.webp0 == 1)
-            {
-                free(pixeldata);
-            }
-            else
-            {
-#if _WIN32
-                free(pixeldata);
-#else
-                stbi_image_free(pixeldata);
-#endif
-            }
-        }
-        {
-            unsigned char* pixeldata = (unsigned char*)v.in1image.data;
-            if (v.webp1 == 1)
-            {
-                free(pixeldata);
-            }
-            else
-            {
-#if _WIN32
-                free(pixeldata);
-#else
-                stbi_image_free(pixeldata);
-#endif
-            }
-        }
+        int ret = v.passthrough == PASSTHROUGH_COPY ? copy_file(v.in0path, v.outpath) : encode_image(v.outpath, v.outimage);
+
+        // input pixel data is freed after its last task
+        decoded_frames.release(v.in0id, v.in0image, v.webp0);
+        decoded_frames.release(v.in1id, v.in1image, v.webp1);
 
         if (ret == 0)
         {
@@ -425,6 +1517,8 @@ void* save(void* args)
 #endif
             }
         }
+
+        delete t;
     }
 
     return 0;
@@ -442,17 +1536,24 @@ int main(int argc, char** argv)
     path_t inputpath;
     path_t outputpath;
     path_t model = PATHSTR("cain");
+    path_t cachepath;
+    std::vector<int> tilesize;
     std::vector<int> gpuid;
     int jobs_load = 1;
     std::vector<int> jobs_proc;
     int jobs_save = 2;
     int verbose = 0;
+    int autotune = 0;
+    int int8 = 0;
+    int precision = CAIN_PRECISION_FP32;
+    int queue_depth = 8;
+    int scale = 2;
     path_t pattern_format = PATHSTR("%08d.png");
 
 #if _WIN32
     setlocale(LC_ALL, "");
     wchar_t opt;
-    while ((opt = getopt(argc, argv, L"0:1:i:o:m:g:j:f:vh")) != (wchar_t)-1)
+    while ((opt = getopt(argc, argv, L"0:1:i:o:n:m:c:t:g:j:f:p:q:d:avh")) != (wchar_t)-1)
     {
         switch (opt)
         {
@@ -468,9 +1569,18 @@ int main(int argc, char** argv)
         case L'o':
             outputpath = optarg;
             break;
+        case L'n':
+            scale = _wtoi(optarg);
+            break;
         case L'm':
             model = optarg;
             break;
+        case L'c':
+            cachepath = optarg;
+            break;
+        case L't':
+            tilesize = parse_optarg_int_array(optarg);
+            break;
         case L'g':
             gpuid = parse_optarg_int_array(optarg);
             break;
@@ -481,6 +1591,18 @@ int main(int argc, char** argv)
         case L'f':
             pattern_format = optarg;
             break;
+        case L'a':
+            autotune = 1;
+            break;
+        case L'p':
+            precision = parse_precision(optarg);
+            break;
+        case L'q':
+            int8 = wcscmp(optarg, L"int8") == 0 ? 1 : -1;
+            break;
+        case L'd':
+            queue_depth = _wtoi(optarg);
+            break;
         case L'v':
             verbose = 1;
             break;
@@ -492,7 +1614,7 @@ int main(int argc, char** argv)
     }
 #else // _WIN32
     int opt;
-    while ((opt = getopt(argc, argv, "0:1:i:o:m:g:j:f:vh")) != -1)
+    while ((opt = getopt(argc, argv, "0:1:i:o:n:m:c:t:g:j:f:p:q:d:avh")) != -1)
     {
         switch (opt)
         {
@@ -508,9 +1630,18 @@ int main(int argc, char** argv)
         case 'o':
             outputpath = optarg;
             break;
+        case 'n':
+            scale = atoi(optarg);
+            break;
         case 'm':
             model = optarg;
             break;
+        case 'c':
+            cachepath = optarg;
+            break;
+        case 't':
+            tilesize = parse_optarg_int_array(optarg);
+            break;
         case 'g':
             gpuid = parse_optarg_int_array(optarg);
             break;
@@ -521,6 +1652,18 @@ int main(int argc, char** argv)
         case 'f':
             pattern_format = optarg;
             break;
+        case 'a':
+            autotune = 1;
+            break;
+        case 'p':
+            precision = parse_precision(optarg);
+            break;
+        case 'q':
+            int8 = strcmp(optarg, "int8") == 0 ? 1 : -1;
+            break;
+        case 'd':
+            queue_depth = atoi(optarg);
+            break;
         case 'v':
             verbose = 1;
             break;
@@ -538,12 +1681,57 @@ int main(int argc, char** argv)
         return -1;
     }
 
+    if (precision == -1)
+    {
+        fprintf(stderr, "invalid precision argument\n");
+        return -1;
+    }
+
+    if (int8 == -1)
+    {
+        fprintf(stderr, "invalid quantize argument\n");
+        return -1;
+    }
+
+    if (!cachepath.empty() && !path_is_directory(cachepath))
+    {
+        fprintf(stderr, "invalid cache path argument\n");
+        return -1;
+    }
+
+    if (tilesize.size() != (gpuid.empty() ? 1 : gpuid.size()) && !tilesize.empty())
+    {
+        fprintf(stderr, "invalid tilesize argument\n");
+        return -1;
+    }
+
+    for (int i=0; i<(int)tilesize.size(); i++)
+    {
+        if (tilesize[i] != 0 && tilesize[i] < 32)
+        {
+            fprintf(stderr, "invalid tilesize argument\n");
+            return -1;
+        }
+    }
+
     if (jobs_load < 1 || jobs_save < 1)
     {
         fprintf(stderr, "invalid thread count argument\n");
         return -1;
     }
 
+    if (scale != 2 && scale != 4 && scale != 8 && scale != 16)
+    {
+        fprintf(stderr, "invalid frame count scale argument\n");
+        return -1;
+    }
+
+    if (queue_depth < 1)
+    {
+        fprintf(stderr, "invalid queue depth argument\n");
+        return -1;
+    }
+
     if (jobs_proc.size() != (gpuid.empty() ? 1 : gpuid.size()) && !jobs_proc.empty())
     {
         fprintf(stderr, "invalid jobs_proc thread count argument\n");
@@ -604,10 +1792,7 @@ int main(int argc, char** argv)
     }
 
     // collect input and output filepath
-    std::vector<path_t> input0_files;
-    std::vector<path_t> input1_files;
-    std::vector<path_t> output_files;
-    std::vector<float> timesteps;
+    TaskList tasks;
     {
         if (!inputpath.empty() && path_is_directory(inputpath) && path_is_directory(outputpath))
         {
@@ -616,60 +1801,17 @@ int main(int argc, char** argv)
             if (lr != 0)
                 return -1;
 
-            const int count = filenames.size();
-            const int numframe = count * 2;
-
-            input0_files.resize(numframe);
-            input1_files.resize(numframe);
-            output_files.resize(numframe);
-            timesteps.resize(numframe);
-
-            double scale = (double)count / numframe;
-            for (int i=0; i<numframe; i++)
-            {
-                // TODO provide option to control timestep interpolate method
-//                 float fx = (float)((i + 0.5) * scale - 0.5);
-                float fx = i * scale;
-                int sx = static_cast<int>(floor(fx));
-                fx -= sx;
-
-                if (sx < 0)
-                {
-                    sx = 0;
-                    fx = 0.f;
-                }
-                if (sx >= count - 1)
-                {
-                    sx = count - 2;
-                    fx = 1.f;
-                }
-
-//                 fprintf(stderr, "%d %f %d\n", i, fx, sx);
-
-                path_t filename0 = filenames[sx];
-                path_t filename1 = filenames[sx + 1];
-
-#if _WIN32
-                wchar_t tmp[256];
-                swprintf(tmp, pattern.c_str(), i+1);
-#else
-                char tmp[256];
-                sprintf(tmp, pattern.c_str(), i+1); // ffmpeg start from 1
-#endif
-                path_t output_filename = path_t(tmp) + PATHSTR('.') + format;
-
-                input0_files[i] = inputpath + PATHSTR('/') + filename0;
-                input1_files[i] = inputpath + PATHSTR('/') + filename1;
-                output_files[i] = outputpath + PATHSTR('/') + output_filename;
-                timesteps[i] = fx;
-            }
+            tasks.init(inputpath, filenames, outputpath, pattern, format, scale);
         }
         else if (inputpath.empty() && !path_is_directory(input0path) && !path_is_directory(input1path) && !path_is_directory(outputpath))
         {
-            input0_files.push_back(input0path);
-            input1_files.push_back(input1path);
-            output_files.push_back(outputpath);
-            timesteps.push_back(0.5f);
+            if (scale != 2)
+            {
+                fprintf(stderr, "frame count scale needs inputpath and outputpath directory\n");
+                return -1;
+            }
+
+            tasks.init(input0path, input1path, outputpath);
         }
         else
         {
@@ -679,6 +1821,10 @@ int main(int argc, char** argv)
         }
     }
 
+#if CAIN_EMBED_MODEL
+    // the model is compiled in, -m is ignored
+    path_t modeldir = model;
+#else
     if (model.find(PATHSTR("cain")) != path_t::npos)
     {
         // fine
@@ -690,6 +1836,7 @@ int main(int argc, char** argv)
     }
 
     path_t modeldir = sanitize_dirpath(model);
+#endif
 
 #if _WIN32
     CoInitializeEx(NULL, COINIT_MULTITHREADED);
@@ -704,6 +1851,11 @@ int main(int argc, char** argv)
 
     const int use_gpu_count = (int)gpuid.size();
 
+    if (tilesize.empty())
+    {
+        tilesize.resize(use_gpu_count, 0);
+    }
+
     if (jobs_proc.empty())
     {
         jobs_proc.resize(use_gpu_count, 2);
@@ -716,7 +1868,7 @@ int main(int argc, char** argv)
     int gpu_count = ncnn::get_gpu_count();
     for (int i=0; i<use_gpu_count; i++)
     {
-        if (gpuid[i] < 0 || gpuid[i] >= gpu_count)
+        if (gpuid[i] < -1 || gpuid[i] >= gpu_count)
         {
             fprintf(stderr, "invalid gpu device\n");
 
@@ -728,9 +1880,38 @@ int main(int argc, char** argv)
     int total_jobs_proc = 0;
     for (int i=0; i<use_gpu_count; i++)
     {
-        int gpu_queue_count = ncnn::get_gpu_info(gpuid[i]).compute_queue_count();
-        jobs_proc[i] = std::min(jobs_proc[i], gpu_queue_count);
-        total_jobs_proc += jobs_proc[i];
+        if (gpuid[i] == -1)
+        {
+            // cpu runs one proc thread with jobs_proc worker threads inside ncnn
+            jobs_proc[i] = std::min(jobs_proc[i], cpu_count);
+            total_jobs_proc += 1;
+        }
+        else
+        {
+            int gpu_queue_count = ncnn::get_gpu_info(gpuid[i]).compute_queue_count();
+            jobs_proc[i] = std::min(jobs_proc[i], gpu_queue_count);
+            total_jobs_proc += jobs_proc[i];
+        }
+    }
+
+    // all frames share the size of the first one
+    int autotune_width = 0;
+    int autotune_height = 0;
+    if (autotune && tasks.size() > 0)
+    {
+        Task v;
+        tasks.get(0, v);
+
+        ncnn::Mat image;
+        int webp = 0;
+        float mean_rgb[3];
+        if (decode_image(v.in0path, image, &webp, mean_rgb) == 0)
+        {
+            autotune_width = image.w;
+            autotune_height = image.h;
+
+            free_pixels((unsigned char*)image.data, webp);
+        }
     }
 
     {
@@ -738,9 +1919,34 @@ int main(int argc, char** argv)
 
         for (int i=0; i<use_gpu_count; i++)
         {
-            cain[i] = new CAIN(gpuid[i]);
+            int num_threads = gpuid[i] == -1 ? jobs_proc[i] : 1;
+
+            cain[i] = new CAIN(gpuid[i], num_threads);
+
+            if (!cachepath.empty())
+            {
+                cain[i]->cachedir = sanitize_dirpath(cachepath);
+            }
+
+            cain[i]->autotune_width = autotune_width;
+            cain[i]->autotune_height = autotune_height;
+            cain[i]->use_int8 = gpuid[i] == -1 ? int8 : 0;
+            cain[i]->precision = precision;
+            // before load, the autotuner benchmarks the map of one tile pass
+            cain[i]->tilesize = tilesize[i];
+
+            if (cain[i]->load(modeldir) != 0)
+            {
+                fprintf(stderr, "load cain model failed\n");
 
-            cain[i]->load(modeldir);
+                for (int j=0; j<=i; j++)
+                {
+                    delete cain[j];
+                }
+
+                ncnn::destroy_gpu_instance();
+                return -1;
+            }
         }
 
         // main routine
@@ -748,10 +1954,14 @@ int main(int argc, char** argv)
             // load image
             LoadThreadParams ltp;
             ltp.jobs_load = jobs_load;
-            ltp.input0_files = input0_files;
-            ltp.input1_files = input1_files;
-            ltp.output_files = output_files;
-            ltp.timesteps = timesteps;
+            ltp.cains = cain;
+            ltp.tasks = &tasks;
+
+            frame_uses.init(&tasks);
+            toproc.init(queue_depth);
+            tosave.init(queue_depth);
+            decoded_frames.init(&tasks);
+            graph.init(&tasks, cain);
 
             ncnn::Thread load_thread(load, (void*)&ltp);
 
@@ -760,6 +1970,7 @@ int main(int argc, char** argv)
             for (int i=0; i<use_gpu_count; i++)
             {
                 ptp[i].cain = cain[i];
+                ptp[i].cains = cain;
             }
 
             std::vector<ncnn::Thread*> proc_threads(total_jobs_proc);
@@ -767,10 +1978,17 @@ int main(int argc, char** argv)
                 int total_jobs_proc_id = 0;
                 for (int i=0; i<use_gpu_count; i++)
                 {
-                    for (int j=0; j<jobs_proc[i]; j++)
+                    if (gpuid[i] == -1)
                     {
                         proc_threads[total_jobs_proc_id++] = new ncnn::Thread(proc, (void*)&ptp[i]);
                     }
+                    else
+                    {
+                        for (int j=0; j<jobs_proc[i]; j++)
+                        {
+                            proc_threads[total_jobs_proc_id++] = new ncnn::Thread(proc, (void*)&ptp[i]);
+                        }
+                    }
                 }
             }
 
@@ -787,11 +2005,13 @@ int main(int argc, char** argv)
             // end
             load_thread.join();
 
-            Task end;
-            end.id = -233;
+            // the deeper levels keep feeding toproc until the last network task is done
+            graph.wait();
 
             for (int i=0; i<total_jobs_proc; i++)
             {
+                Task* end = new Task;
+                end->id = -233;
                 toproc.put(end);
             }
 
@@ -803,6 +2023,8 @@ int main(int argc, char** argv)
 
             for (int i=0; i<jobs_save; i++)
             {
+                Task* end = new Task;
+                end->id = -233;
                 tosave.put(end);
             }
 